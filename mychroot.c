@@ -1,13 +1,58 @@
+/*
+ * usage:
+ *   mychroot [--trace profile] [--prefetch profile] [-j jobs]
+ *       [--stats {text/json}] [--cpu-max value] [--memory-max value]
+ *       [--io-max value] [directory] [command]...
+ *
+ * --trace writes the files the command opens through the root to profile,
+ * in the order they were first opened. --prefetch reads such a profile and
+ * asks for those files to be read into the page cache before the command
+ * starts, using jobs threads.
+ *
+ * --stats and the limits run the command in a cgroup v2 group of its own,
+ * made below the cgroup of mychroot so a delegated cgroup is enough. a
+ * cgroup with processes in it cannot enable controllers below it, so
+ * mychroot moves into a leaf of that group for the run and the limits need
+ * it to be alone in its cgroup. runs started from the same cgroup at the
+ * same time share the mychroot-idle leaf on the way out, which is removed by
+ * the last of them to finish. limit values are written as given to
+ * cpu.max, memory.max and io.max. --stats reports the exit status, wall
+ * time, cpu time, peak memory and io bytes of the command to stderr.
+ * figures the group cannot give, because its controller is not enabled,
+ * are taken from the rusage of the command.
+ *
+ * mychroot exits with the exit status of the command, or 128 plus the
+ * signal that killed it.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/fanotify.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <sys/mount.h>
 
 #define ENV_VAR_MAX 1024
+#define TRACE_BUF_SIZE 8192
+#define TRACE_POLL_MS 100
+#define PREFETCH_DEFAULT_JOBS 8
+#define CGROUP_FILE_MAX 4096
+#define CGROUP_CONTROLLER_MAX 32
+#define CGROUP_SUPERVISOR "supervisor"
+#define CGROUP_CMD "cmd"
+#define CGROUP_IDLE "mychroot-idle"
+#define CGROUP_ENABLE_TRIES 3
 
 #define PROC_DIR "/proc"
 #define SYS_DIR "/sys"
@@ -15,53 +60,933 @@
 #define DEV_HOST "/dev"
 #define DEV_TARGET "/dev"
 
-int fork_exec_wait(char** args, char **environment);
+/*
+ * regular files opened through the traced mount. paths holds them in the
+ * order first seen, table is an open addressed set of the same strings.
+ */
+struct trace {
+    int fd;
+    char **paths;
+    size_t count;
+    size_t capacity;
+    char **table;
+    size_t table_size;
+    int overflowed;
+};
+
+struct prefetch_ctx {
+    char **paths;
+    size_t count;
+    size_t next;
+    pthread_mutex_t lock;
+};
+
+/*
+ * the group made for a command in our own cgroup, own. mychroot sits in its
+ * supervisor leaf once joined is set and the command runs in its cmd leaf,
+ * open as fd. fds are -1 when there is none.
+ */
+struct cgroup {
+    int parent_fd;
+    int group_fd;
+    int fd;
+    int joined;
+    char *own;
+    char *name;
+    char *path;
+    char disable[4 * CGROUP_CONTROLLER_MAX];
+};
+
+struct run_stats {
+    int status;
+    struct rusage usage;
+    struct timespec start;
+    struct timespec end;
+};
+
+uint32_t path_hash(char *path);
+int trace_start(struct trace *trace);
+int trace_add(struct trace *trace, char *path);
+int trace_read(struct trace *trace);
+int trace_write(struct trace *trace, FILE *profile);
+void trace_free(struct trace *trace);
+int read_profile(char *file_name, char ***paths, size_t *count);
+void *prefetch_worker(void *ctx);
+int prefetch(char **paths, size_t count, int jobs);
+int cgroup_own_path(char *buf);
+int cgroup_write(int dir_fd, char *file_name, char *value);
+ssize_t cgroup_read(int dir_fd, char *file_name, char *buf);
+int cgroup_enable(struct cgroup *cgroup, char *controller, int needed, int busy);
+int cgroup_create(
+    struct cgroup *cgroup, char *cpu_max, char *memory_max, char *io_max);
+void cgroup_remove(struct cgroup *cgroup);
+long long stat_key(char *text, char *key);
+void report_stats(struct run_stats *stats, struct cgroup *cgroup, int json);
+int exit_code(int status);
+int fork_exec_wait(
+    char** args,
+    char **environment,
+    struct trace *trace,
+    struct cgroup *cgroup,
+    struct run_stats *stats);
 
 char *DEFAULT_CMD[2] = {"/bin/sh", NULL};
 
+uint32_t
+path_hash(char *path)
+{
+    uint32_t hash = 2166136261u;
+
+    for(; *path; path++)
+        hash = (hash ^ (unsigned char)*path) * 16777619u;
+    return hash;
+}
+
+/*
+ * watch opens on the mount of the current root. the caller bind mounts the
+ * root onto itself first so only access through the chroot is seen. files
+ * on mounts below the root are not traced.
+ */
+int
+trace_start(struct trace *trace)
+{
+    memset(trace, 0, sizeof(*trace));
+    trace->fd = fanotify_init(
+        FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK | FAN_UNLIMITED_QUEUE,
+        O_RDONLY | O_CLOEXEC);
+    if(trace->fd < 0) {
+        perror("fanotify_init failed");
+        return 1;
+    }
+    if(fanotify_mark(trace->fd, FAN_MARK_ADD | FAN_MARK_MOUNT, FAN_OPEN,
+            AT_FDCWD, "/") < 0) {
+        perror("failed to mark root for tracing");
+        close(trace->fd);
+        trace->fd = -1;
+        return 1;
+    }
+    return 0;
+}
+
+/* note path unless it was seen before */
+int
+trace_add(struct trace *trace, char *path)
+{
+    size_t i, mask;
+    char **table, **paths;
+
+    if(trace->count * 2 >= trace->table_size) {
+        size_t size = trace->table_size ? trace->table_size * 2 : 1024;
+        table = calloc(size, sizeof(*table));
+        if(table == NULL) {
+            perror("malloc failed");
+            return 1;
+        }
+        for(size_t j = 0; j < trace->count; j++) {
+            i = path_hash(trace->paths[j]) & (size - 1);
+            while(table[i] != NULL)
+                i = (i + 1) & (size - 1);
+            table[i] = trace->paths[j];
+        }
+        free(trace->table);
+        trace->table = table;
+        trace->table_size = size;
+    }
+
+    mask = trace->table_size - 1;
+    for(i = path_hash(path) & mask; trace->table[i] != NULL; i = (i + 1) & mask)
+        if(strcmp(trace->table[i], path) == 0)
+            return 0;
+
+    if(trace->count == trace->capacity) {
+        trace->capacity = trace->capacity ? trace->capacity * 2 : 256;
+        paths = realloc(trace->paths, trace->capacity * sizeof(*paths));
+        if(paths == NULL) {
+            perror("realloc failed");
+            return 1;
+        }
+        trace->paths = paths;
+    }
+    trace->table[i] = trace->paths[trace->count] = strdup(path);
+    if(trace->table[i] == NULL) {
+        perror("strdup failed");
+        return 1;
+    }
+    trace->count++;
+    return 0;
+}
+
+/* read every event that is ready */
+int
+trace_read(struct trace *trace)
+{
+    int ret = 0;
+    ssize_t len, link_len;
+    char *buf, *fd_path, *path;
+    struct fanotify_event_metadata *event;
+    struct stat st;
+
+    buf = malloc(TRACE_BUF_SIZE);
+    fd_path = malloc(PATH_MAX);
+    path = malloc(PATH_MAX);
+    if(buf == NULL || fd_path == NULL || path == NULL) {
+        perror("malloc failed");
+        ret = 1;
+        goto cleanup;
+    }
+
+    for(;;) {
+        len = read(trace->fd, buf, TRACE_BUF_SIZE);
+        if(len < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno != EAGAIN) {
+                perror("failed to read fanotify events");
+                ret = 1;
+            }
+            goto cleanup;
+        }
+        event = (struct fanotify_event_metadata *)buf;
+        for(; FAN_EVENT_OK(event, len); event = FAN_EVENT_NEXT(event, len)) {
+            if(event->mask & FAN_Q_OVERFLOW)
+                trace->overflowed = 1;
+            if(event->fd < 0)
+                continue;
+            /* files already unlinked are temporary, not worth keeping */
+            if(fstat(event->fd, &st) == 0 && S_ISREG(st.st_mode)
+                && st.st_nlink > 0) {
+                snprintf(fd_path, PATH_MAX, "/proc/self/fd/%d", event->fd);
+                link_len = readlink(fd_path, path, PATH_MAX - 1);
+                if(link_len > 0) {
+                    path[link_len] = '\0';
+                    if(trace_add(trace, path))
+                        ret = 1;
+                }
+            }
+            close(event->fd);
+        }
+    }
+
+cleanup:
+    free(buf);
+    free(fd_path);
+    free(path);
+    return ret;
+}
+
+int
+trace_write(struct trace *trace, FILE *profile)
+{
+    if(trace->overflowed)
+        fprintf(stderr, "fanotify queue overflowed, profile is incomplete\n");
+    for(size_t i = 0; i < trace->count; i++)
+        fprintf(profile, "%s\n", trace->paths[i]);
+    if(fflush(profile) == EOF || ferror(profile)) {
+        perror("failed to write profile");
+        return 1;
+    }
+    return 0;
+}
+
+void
+trace_free(struct trace *trace)
+{
+    if(trace->fd >= 0)
+        close(trace->fd);
+    for(size_t i = 0; i < trace->count; i++)
+        free(trace->paths[i]);
+    free(trace->paths);
+    free(trace->table);
+}
+
+/* read a profile, one path per line */
+int
+read_profile(char *file_name, char ***paths, size_t *count)
+{
+    int ret = 0;
+    size_t capacity, line_size;
+    ssize_t len;
+    char *line, **new_paths;
+    FILE *file;
+
+    *paths = NULL;
+    *count = capacity = 0;
+    line = NULL;
+    line_size = 0;
+
+    file = fopen(file_name, "r");
+    if(file == NULL) {
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to open profile '%s': %s\n", file_name, err);
+        return 1;
+    }
+    while((len = getline(&line, &line_size, file)) > 0) {
+        if(line[len - 1] == '\n')
+            line[--len] = '\0';
+        if(len == 0)
+            continue;
+        if(*count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            new_paths = realloc(*paths, capacity * sizeof(*new_paths));
+            if(new_paths == NULL) {
+                perror("realloc failed");
+                ret = 1;
+                goto cleanup;
+            }
+            *paths = new_paths;
+        }
+        (*paths)[*count] = strdup(line);
+        if((*paths)[*count] == NULL) {
+            perror("strdup failed");
+            ret = 1;
+            goto cleanup;
+        }
+        (*count)++;
+    }
+    if(ferror(file)) {
+        fprintf(stderr, "failed to read profile '%s'\n", file_name);
+        ret = 1;
+    }
+
+cleanup:
+    free(line);
+    fclose(file);
+    return ret;
+}
+
+/*
+ * files are claimed in profile order so the ones needed first are asked
+ * for first. missing files are skipped, the profile may be from an older
+ * root.
+ */
+void *
+prefetch_worker(void *ctx)
+{
+    int fd;
+    size_t i;
+    struct prefetch_ctx *cast_ctx = ctx;
+
+    for(;;) {
+        pthread_mutex_lock(&cast_ctx->lock);
+        i = cast_ctx->next++;
+        pthread_mutex_unlock(&cast_ctx->lock);
+        if(i >= cast_ctx->count)
+            break;
+        fd = open(cast_ctx->paths[i], O_RDONLY | O_CLOEXEC);
+        if(fd < 0)
+            continue;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        close(fd);
+    }
+    return NULL;
+}
+
+int
+prefetch(char **paths, size_t count, int jobs)
+{
+    int started;
+    pthread_t *threads;
+    struct prefetch_ctx ctx;
+
+    ctx.paths = paths;
+    ctx.count = count;
+    ctx.next = 0;
+    pthread_mutex_init(&ctx.lock, NULL);
+
+    threads = malloc(jobs * sizeof(*threads));
+    if(threads == NULL) {
+        perror("malloc failed");
+        pthread_mutex_destroy(&ctx.lock);
+        return 1;
+    }
+    for(started = 0; started < jobs; started++)
+        if(pthread_create(&threads[started], NULL, prefetch_worker, &ctx))
+            break;
+    /* with no thread at all do the work here */
+    if(started == 0)
+        prefetch_worker(&ctx);
+    for(int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    free(threads);
+    pthread_mutex_destroy(&ctx.lock);
+    return 0;
+}
+
+/*
+ * the directory of the cgroup this process is in, found from the cgroup2
+ * mount in mountinfo and the unified hierarchy line of /proc/self/cgroup.
+ */
+int
+cgroup_own_path(char *buf)
+{
+    int ret = 1;
+    size_t line_size = 0;
+    char *line, *mount_point, *own, *sep;
+    FILE *f;
+
+    line = mount_point = own = NULL;
+    f = fopen("/proc/self/mountinfo", "r");
+    if(f == NULL) {
+        perror("failed to open mountinfo");
+        return 1;
+    }
+    while(getline(&line, &line_size, f) > 0) {
+        /* the fields after " - " start with the filesystem type */
+        sep = strstr(line, " - ");
+        if(sep == NULL || strncmp(sep + 3, "cgroup2 ", 8) != 0)
+            continue;
+        if(sscanf(line, "%*s %*s %*s %*s %ms", &mount_point) == 1)
+            break;
+    }
+    fclose(f);
+    if(mount_point == NULL) {
+        fprintf(stderr, "no cgroup2 filesystem is mounted\n");
+        goto cleanup;
+    }
+
+    f = fopen("/proc/self/cgroup", "r");
+    if(f == NULL) {
+        perror("failed to open /proc/self/cgroup");
+        goto cleanup;
+    }
+    while(getline(&line, &line_size, f) > 0) {
+        if(strncmp(line, "0::", 3) != 0)
+            continue;
+        line[strcspn(line, "\n")] = '\0';
+        /* the root cgroup is "/", keep the joined path free of "//" */
+        own = strcmp(line + 3, "/") == 0 ? "" : line + 3;
+        break;
+    }
+    fclose(f);
+    if(own == NULL) {
+        fprintf(stderr, "not in a cgroup v2 hierarchy\n");
+        goto cleanup;
+    }
+    if(snprintf(buf, PATH_MAX, "%s%s", mount_point, own) >= PATH_MAX) {
+        fprintf(stderr, "cgroup path exceeds PATH_MAX\n");
+        goto cleanup;
+    }
+    ret = 0;
+
+cleanup:
+    free(line);
+    free(mount_point);
+    return ret;
+}
+
+int
+cgroup_write(int dir_fd, char *file_name, char *value)
+{
+    int fd;
+    ssize_t len;
+
+    fd = openat(dir_fd, file_name, O_WRONLY | O_CLOEXEC);
+    if(fd < 0)
+        return 1;
+    len = write(fd, value, strlen(value));
+    close(fd);
+    return len < 0;
+}
+
+/* read a cgroup file into buf of CGROUP_FILE_MAX bytes, -1 on failure */
+ssize_t
+cgroup_read(int dir_fd, char *file_name, char *buf)
+{
+    int fd;
+    ssize_t len;
+
+    fd = openat(dir_fd, file_name, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return -1;
+    len = read(fd, buf, CGROUP_FILE_MAX - 1);
+    close(fd);
+    if(len >= 0)
+        buf[len] = '\0';
+    return len;
+}
+
+/*
+ * enable controller for the children of our own cgroup and then for those
+ * of the group, where the command's leaf gets it. it may be missing unless
+ * needed. controllers turned on in our own cgroup are noted in disable so
+ * cgroup_remove can turn them off again to move back into it. another run
+ * finishing may turn it off in our own cgroup between the two writes, which
+ * makes the second fail with ENOENT, so that is tried again.
+ */
 int
-fork_exec_wait(char** args, char **environment)
+cgroup_enable(struct cgroup *cgroup, char *controller, int needed, int busy)
 {
-    pid_t pid;
+    int tries;
+    char value[CGROUP_CONTROLLER_MAX];
 
+    snprintf(value, sizeof(value), "+%s", controller);
+    for(tries = 1; ; tries++) {
+        if(cgroup_write(cgroup->parent_fd, "cgroup.subtree_control", value)) {
+            if(!needed)
+                return 0;
+            char *err = strerror(errno);
+            if(busy)
+                fprintf(stderr, "cgroup '%s' has other processes in it, run "
+                    "mychroot in a cgroup of its own to limit %s\n",
+                    cgroup->own, controller);
+            else
+                fprintf(stderr, "failed to enable %s controller in '%s': "
+                    "%s\n", controller, cgroup->own, err);
+            return 1;
+        }
+        if(tries == 1)
+            snprintf(&cgroup->disable[strlen(cgroup->disable)],
+                sizeof(cgroup->disable) - strlen(cgroup->disable), "-%s ",
+                controller);
+        if(cgroup_write(cgroup->group_fd, "cgroup.subtree_control", value)
+            == 0)
+            return 0;
+        if(errno != ENOENT || tries == CGROUP_ENABLE_TRIES)
+            break;
+    }
+    if(!needed)
+        return 0;
+    char *err = strerror(errno);
+    fprintf(stderr, "failed to enable %s controller in '%s': %s\n",
+        controller, cgroup->path, err);
+    return 1;
+}
+
+/*
+ * make a group for the command below our own cgroup and apply the limits
+ * that are not NULL. a cgroup with processes in it cannot enable controllers
+ * for its children, so mychroot first moves itself into the supervisor leaf
+ * of the group and the command runs in the cmd leaf next to it. those only
+ * used for accounting may be missing.
+ */
+int
+cgroup_create(
+    struct cgroup *cgroup, char *cpu_max, char *memory_max, char *io_max)
+{
+    int ret = 0;
+    int busy;
+    char *procs;
+
+    procs = malloc(CGROUP_FILE_MAX);
+    cgroup->own = malloc(PATH_MAX);
+    cgroup->name = malloc(NAME_MAX);
+    cgroup->path = malloc(PATH_MAX);
+    if(procs == NULL || cgroup->own == NULL || cgroup->name == NULL
+        || cgroup->path == NULL) {
+        perror("malloc failed");
+        ret = 1;
+        goto cleanup;
+    }
+    if(cgroup_own_path(cgroup->own)) {
+        ret = 1;
+        goto cleanup;
+    }
+    cgroup->parent_fd = open(cgroup->own, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(cgroup->parent_fd < 0) {
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to open cgroup '%s': %s\n", cgroup->own, err);
+        ret = 1;
+        goto cleanup;
+    }
+
+    snprintf(cgroup->name, NAME_MAX, "mychroot-%d", (int)getpid());
+    if(snprintf(cgroup->path, PATH_MAX, "%s/%s", cgroup->own, cgroup->name)
+            >= PATH_MAX) {
+        fprintf(stderr, "cgroup path exceeds PATH_MAX\n");
+        ret = 1;
+        goto cleanup;
+    }
+    if(mkdirat(cgroup->parent_fd, cgroup->name, 0755) < 0) {
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to make cgroup '%s': %s\n", cgroup->path,
+            err);
+        ret = 1;
+        goto cleanup;
+    }
+    cgroup->group_fd = openat(cgroup->parent_fd, cgroup->name,
+        O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(cgroup->group_fd < 0) {
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to open cgroup '%s': %s\n", cgroup->path,
+            err);
+        unlinkat(cgroup->parent_fd, cgroup->name, AT_REMOVEDIR);
+        ret = 1;
+        goto cleanup;
+    }
+
+    if(mkdirat(cgroup->group_fd, CGROUP_SUPERVISOR, 0755) < 0
+        || cgroup_write(cgroup->group_fd,
+            CGROUP_SUPERVISOR "/cgroup.procs", "0")) {
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to move into cgroup '%s/%s': %s\n",
+            cgroup->path, CGROUP_SUPERVISOR, err);
+        ret = 1;
+        goto cleanup;
+    }
+    cgroup->joined = 1;
+    busy = cgroup_read(cgroup->parent_fd, "cgroup.procs", procs) != 0;
+
+    if(cgroup_enable(cgroup, "memory", memory_max != NULL, busy)
+        || cgroup_enable(cgroup, "io", io_max != NULL, busy)
+        || (cpu_max != NULL && cgroup_enable(cgroup, "cpu", 1, busy))) {
+        ret = 1;
+        goto cleanup;
+    }
+
+    if(mkdirat(cgroup->group_fd, CGROUP_CMD, 0755) < 0) {
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to make cgroup '%s/%s': %s\n", cgroup->path,
+            CGROUP_CMD, err);
+        ret = 1;
+        goto cleanup;
+    }
+    cgroup->fd = openat(cgroup->group_fd, CGROUP_CMD,
+        O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(cgroup->fd < 0) {
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to open cgroup '%s/%s': %s\n", cgroup->path,
+            CGROUP_CMD, err);
+        unlinkat(cgroup->group_fd, CGROUP_CMD, AT_REMOVEDIR);
+        ret = 1;
+        goto cleanup;
+    }
+
+    if((cpu_max != NULL && cgroup_write(cgroup->fd, "cpu.max", cpu_max))
+        || (memory_max != NULL
+            && cgroup_write(cgroup->fd, "memory.max", memory_max))
+        || (io_max != NULL && cgroup_write(cgroup->fd, "io.max", io_max))) {
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to set limits of '%s/%s': %s\n",
+            cgroup->path, CGROUP_CMD, err);
+        ret = 1;
+        goto cleanup;
+    }
+
+cleanup:
+    free(procs);
+    return ret;
+}
+
+/*
+ * the group is only removed once nothing is left running in it, so mychroot
+ * moves out into the idle leaf first. our own cgroup cannot take it back
+ * while controllers are enabled for its children, and those it turned on
+ * cannot be turned off while another run's group still uses them, so the
+ * idle leaf is shared by runs from our own cgroup. mychroot then returns to
+ * our own cgroup and removes the idle leaf if it can, which the last run to
+ * finish does.
+ */
+void
+cgroup_remove(struct cgroup *cgroup)
+{
+    if(cgroup->fd >= 0) {
+        close(cgroup->fd);
+        if(unlinkat(cgroup->group_fd, CGROUP_CMD, AT_REMOVEDIR) < 0) {
+            char *err = strerror(errno);
+            fprintf(stderr, "failed to remove cgroup '%s/%s': %s\n",
+                cgroup->path, CGROUP_CMD, err);
+        }
+    }
+    if(cgroup->joined
+        && ((mkdirat(cgroup->parent_fd, CGROUP_IDLE, 0755) < 0
+                && errno != EEXIST)
+            || cgroup_write(cgroup->parent_fd, CGROUP_IDLE "/cgroup.procs",
+                "0"))) {
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to move into cgroup '%s/%s': %s\n",
+            cgroup->own, CGROUP_IDLE, err);
+        goto cleanup;
+    }
+    if(cgroup->group_fd >= 0) {
+        if(unlinkat(cgroup->group_fd, CGROUP_SUPERVISOR, AT_REMOVEDIR) < 0
+            && errno != ENOENT) {
+            char *err = strerror(errno);
+            fprintf(stderr, "failed to remove cgroup '%s/%s': %s\n",
+                cgroup->path, CGROUP_SUPERVISOR, err);
+        }
+        if(unlinkat(cgroup->parent_fd, cgroup->name, AT_REMOVEDIR) < 0) {
+            char *err = strerror(errno);
+            fprintf(stderr, "failed to remove cgroup '%s': %s\n",
+                cgroup->path, err);
+        }
+    }
+    /* any of these fail while another run is still going, which is fine */
+    if(cgroup->joined
+        && (cgroup->disable[0] == '\0'
+            || cgroup_write(cgroup->parent_fd, "cgroup.subtree_control",
+                cgroup->disable) == 0)
+        && cgroup_write(cgroup->parent_fd, "cgroup.procs", "0") == 0)
+        unlinkat(cgroup->parent_fd, CGROUP_IDLE, AT_REMOVEDIR);
+
+cleanup:
+    if(cgroup->group_fd >= 0)
+        close(cgroup->group_fd);
+    if(cgroup->parent_fd >= 0)
+        close(cgroup->parent_fd);
+    free(cgroup->own);
+    free(cgroup->name);
+    free(cgroup->path);
+}
+
+/* value of a "key value" line of a flat keyed file, -1 when missing */
+long long
+stat_key(char *text, char *key)
+{
+    size_t key_len = strlen(key);
+    char *line = text;
+
+    while(line != NULL) {
+        if(strncmp(line, key, key_len) == 0 && line[key_len] == ' ')
+            return atoll(line + key_len + 1);
+        line = strchr(line, '\n');
+        if(line != NULL)
+            line++;
+    }
+    return -1;
+}
+
+void
+report_stats(struct run_stats *stats, struct cgroup *cgroup, int json)
+{
+    long long wall_usec, user_usec, system_usec, cpu_usec;
+    long long memory_peak, read_bytes, write_bytes, value;
+    char *buf, *p;
+
+    wall_usec = (stats->end.tv_sec - stats->start.tv_sec) * 1000000LL
+        + (stats->end.tv_nsec - stats->start.tv_nsec) / 1000;
+    user_usec = stats->usage.ru_utime.tv_sec * 1000000LL
+        + stats->usage.ru_utime.tv_usec;
+    system_usec = stats->usage.ru_stime.tv_sec * 1000000LL
+        + stats->usage.ru_stime.tv_usec;
+    cpu_usec = user_usec + system_usec;
+    memory_peak = stats->usage.ru_maxrss * 1024LL;
+    read_bytes = stats->usage.ru_inblock * 512LL;
+    write_bytes = stats->usage.ru_oublock * 512LL;
+
+    buf = malloc(CGROUP_FILE_MAX);
+    if(buf != NULL && cgroup->fd >= 0) {
+        if(cgroup_read(cgroup->fd, "cpu.stat", buf) > 0
+            && stat_key(buf, "usage_usec") >= 0) {
+            cpu_usec = stat_key(buf, "usage_usec");
+            user_usec = stat_key(buf, "user_usec");
+            system_usec = stat_key(buf, "system_usec");
+        }
+        if(cgroup_read(cgroup->fd, "memory.peak", buf) > 0)
+            memory_peak = atoll(buf);
+        /* one line per device of "major:minor key=value..." */
+        if(cgroup_read(cgroup->fd, "io.stat", buf) >= 0) {
+            read_bytes = write_bytes = 0;
+            for(p = buf; (p = strstr(p, "bytes=")) != NULL; p += 6) {
+                value = atoll(p + 6);
+                if(p - buf >= 1 && p[-1] == 'r')
+                    read_bytes += value;
+                else if(p - buf >= 1 && p[-1] == 'w')
+                    write_bytes += value;
+            }
+        }
+    }
+    free(buf);
+
+    if(json) {
+        fprintf(stderr, "{\"exit_code\": %d, \"signal\": %d, "
+            "\"wall_usec\": %lld, \"cpu_usec\": %lld, \"user_usec\": %lld, "
+            "\"system_usec\": %lld, \"memory_peak_bytes\": %lld, "
+            "\"io_read_bytes\": %lld, \"io_write_bytes\": %lld}\n",
+            WIFEXITED(stats->status) ? WEXITSTATUS(stats->status) : -1,
+            WIFSIGNALED(stats->status) ? WTERMSIG(stats->status) : 0,
+            wall_usec, cpu_usec, user_usec, system_usec, memory_peak,
+            read_bytes, write_bytes);
+        return;
+    }
+    if(WIFSIGNALED(stats->status))
+        fprintf(stderr, "killed by signal %d\n", WTERMSIG(stats->status));
+    else
+        fprintf(stderr, "exit status %d\n", WEXITSTATUS(stats->status));
+    fprintf(stderr, "wall time %lld.%06llds\n", wall_usec / 1000000,
+        wall_usec % 1000000);
+    fprintf(stderr, "cpu time %lld.%06llds (user %lld.%06llds, "
+        "system %lld.%06llds)\n", cpu_usec / 1000000, cpu_usec % 1000000,
+        user_usec / 1000000, user_usec % 1000000,
+        system_usec / 1000000, system_usec % 1000000);
+    fprintf(stderr, "peak memory %lld bytes\n", memory_peak);
+    fprintf(stderr, "io %lld bytes read, %lld bytes written\n",
+        read_bytes, write_bytes);
+}
+
+int
+exit_code(int status)
+{
+    if(WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return WEXITSTATUS(status);
+}
+
+/*
+ * with trace set, its events are read until the child exits. with a cgroup
+ * the child moves itself into it before execve so all it runs is counted.
+ */
+int
+fork_exec_wait(
+    char** args,
+    char **environment,
+    struct trace *trace,
+    struct cgroup *cgroup,
+    struct run_stats *stats)
+{
+    int ret = 0;
+    pid_t pid, waited;
+    struct pollfd pfd;
+
+    clock_gettime(CLOCK_MONOTONIC, &stats->start);
     pid = fork();
     if(pid < 0) {
         perror("fork failed");
         return 1;
     }
     if(pid == 0) {
+        if(cgroup->fd >= 0 && cgroup_write(cgroup->fd, "cgroup.procs", "0")) {
+            perror("failed to join cgroup");
+            exit(1);
+        }
         execve(args[0], args, environment);
         perror("execve failed");
         exit(1);
     }
 
-    if(waitpid(pid, NULL, 0) < 0) {
+    if(trace == NULL) {
+        while((waited = wait4(pid, &stats->status, 0, &stats->usage)) < 0
+            && errno == EINTR);
+    } else {
+        pfd.fd = trace->fd;
+        pfd.events = POLLIN;
+        do {
+            if(poll(&pfd, 1, TRACE_POLL_MS) > 0 && trace_read(trace))
+                ret = 1;
+            waited = wait4(pid, &stats->status, WNOHANG, &stats->usage);
+        } while(waited == 0 || (waited < 0 && errno == EINTR));
+        /* events of the last opens may still be queued */
+        if(trace_read(trace))
+            ret = 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stats->end);
+    if(waited < 0) {
         perror("waitpid failed");
         return 1;
     }
-
-    return 0;
+    return ret;
 }
 
 int
 main(int argc, char **argv)
 {
-    int ret, i;
+    int ret, arg, jobs, bound;
     char *dir_name, **cmd, *new_dev, *term, *term_env, *environment[4];
+    char *trace_file, *prefetch_file, **prefetch_paths;
+    char *stats_format, *cpu_max, *memory_max, *io_max;
+    size_t prefetch_count;
+    FILE *profile;
+    struct trace trace;
+    struct cgroup cgroup;
+    struct run_stats stats;
 
     ret = 0;
     term_env = new_dev = NULL;
+    trace_file = prefetch_file = NULL;
+    prefetch_paths = NULL;
+    prefetch_count = 0;
+    profile = NULL;
+    trace.fd = -1;
+    trace.count = 0;
+    trace.paths = trace.table = NULL;
+    jobs = PREFETCH_DEFAULT_JOBS;
+    bound = 0;
+    stats_format = cpu_max = memory_max = io_max = NULL;
+    cgroup.parent_fd = cgroup.group_fd = cgroup.fd = -1;
+    cgroup.joined = 0;
+    cgroup.own = cgroup.name = cgroup.path = NULL;
+    cgroup.disable[0] = '\0';
 
-    if(argc < 2) {
+    for(arg = 1; arg < argc && argv[arg][0] == '-'; arg++) {
+        if(arg + 1 >= argc) {
+            fprintf(stderr, "option '%s' requires an argument\n", argv[arg]);
+            ret = 1;
+            goto cleanup;
+        }
+        if(strcmp(argv[arg], "--trace") == 0) {
+            trace_file = argv[++arg];
+        } else if(strcmp(argv[arg], "--prefetch") == 0) {
+            prefetch_file = argv[++arg];
+        } else if(strcmp(argv[arg], "--stats") == 0) {
+            stats_format = argv[++arg];
+            if(strcmp(stats_format, "text") != 0
+                && strcmp(stats_format, "json") != 0) {
+                fprintf(stderr, "invalid stats format '%s'\n", stats_format);
+                ret = 1;
+                goto cleanup;
+            }
+        } else if(strcmp(argv[arg], "--cpu-max") == 0) {
+            cpu_max = argv[++arg];
+        } else if(strcmp(argv[arg], "--memory-max") == 0) {
+            memory_max = argv[++arg];
+        } else if(strcmp(argv[arg], "--io-max") == 0) {
+            io_max = argv[++arg];
+        } else if(strcmp(argv[arg], "-j") == 0) {
+            jobs = atoi(argv[++arg]);
+            if(jobs < 1) {
+                fprintf(stderr, "invalid job count '%s'\n", argv[arg]);
+                ret = 1;
+                goto cleanup;
+            }
+        } else {
+            fprintf(stderr, "unrecognised option '%s'\n", argv[arg]);
+            ret = 1;
+            goto cleanup;
+        }
+    }
+
+    if(arg >= argc) {
         fprintf(stderr, "too few arguments\n");
         ret = 1;
         goto cleanup;
-    } if(argc == 2) {
-        dir_name = argv[1];
+    } if(arg + 1 == argc) {
+        dir_name = argv[arg];
         cmd = DEFAULT_CMD;
     } else {
-        dir_name = argv[1];
-        cmd = &argv[2];
+        dir_name = argv[arg];
+        cmd = &argv[arg + 1];
+    }
+
+    /* the cgroup hierarchy is not visible from inside the root */
+    if((stats_format != NULL || cpu_max != NULL || memory_max != NULL
+            || io_max != NULL)
+        && cgroup_create(&cgroup, cpu_max, memory_max, io_max)) {
+        ret = 1;
+        goto cleanup;
+    }
+
+    /* profiles are named outside the root, so open them before chroot */
+    if(prefetch_file != NULL
+        && read_profile(prefetch_file, &prefetch_paths, &prefetch_count)) {
+        ret = 1;
+        goto cleanup;
+    }
+    if(trace_file != NULL) {
+        profile = fopen(trace_file, "w");
+        if(profile == NULL) {
+            char *err = strerror(errno);
+            fprintf(stderr, "failed to open profile '%s': %s\n", trace_file,
+                err);
+            ret = 1;
+            goto cleanup;
+        }
+        /* a mount of its own lets the trace see only access through it */
+        if(mount(dir_name, dir_name, NULL, MS_BIND | MS_REC, NULL) < 0) {
+            perror("failed to bind mount root");
+            ret = 1;
+            goto cleanup;
+        }
+        bound = 1;
     }
 
     new_dev = malloc(PATH_MAX);
@@ -130,7 +1055,23 @@ main(int argc, char **argv)
     environment[2] = term_env; /* possibly NULL */
     environment[3] = NULL;
 
-    fork_exec_wait(cmd, environment);
+    if(prefetch_paths != NULL)
+        prefetch(prefetch_paths, prefetch_count, jobs);
+
+    if(profile != NULL && trace_start(&trace)) {
+        ret = 1;
+        goto cleanup;
+    }
+    if(fork_exec_wait(cmd, environment, profile != NULL ? &trace : NULL,
+            &cgroup, &stats) == 0) {
+        if(stats_format != NULL)
+            report_stats(&stats, &cgroup, strcmp(stats_format, "json") == 0);
+        ret = exit_code(stats.status);
+    } else {
+        ret = 1;
+    }
+    if(profile != NULL && trace_write(&trace, profile))
+        ret = 1;
 
     if(umount(DEV_TARGET) < 0) {
         perror("failed to unmount tmpfs");
@@ -152,8 +1093,21 @@ main(int argc, char **argv)
         ret = 1;
         goto cleanup;
     }
+    /* the root is still in use by this process, so detach it */
+    if(bound && umount2("/", MNT_DETACH) < 0) {
+        perror("failed to unmount root");
+        ret = 1;
+        goto cleanup;
+    }
 
 cleanup:
+    if(profile != NULL)
+        fclose(profile);
+    for(size_t i = 0; i < prefetch_count; i++)
+        free(prefetch_paths[i]);
+    free(prefetch_paths);
+    trace_free(&trace);
+    cgroup_remove(&cgroup);
     free(new_dev);
     free(term_env);
     return ret;
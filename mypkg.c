@@ -1,17 +1,44 @@
 /*
  * usage:
  *   mypkg {install/uninstall} [package directory]... [target directory]
+ *   mypkg install [-j jobs] [--flatten-links] [--no-wait]
+ *       [--include pattern] [--exclude pattern] [-t target directory]...
+ *       [package directory]...
+ *   mypkg uninstall [-j jobs] [--no-wait] [-t target directory]...
+ *       [package directory]...
+ *   mypkg {digest/verify/index} [package directory]...
+ *   mypkg gc [-n] [target directory]
+ *   mypkg sync [-j jobs] [--flatten-links] [--no-wait]
+ *       [--include pattern] [--exclude pattern]
+ *       [package list file] [target directory]
+ *   mypkg watch [--flatten-links] [--no-wait]
+ *       [--include pattern] [--exclude pattern] [-t target directory]...
+ *       [package directory]...
+ *
+ * --include and --exclude rules, after the include and exclude lines of a
+ * package's pkginfo, choose which of its files are installed. the last rule
+ * matching a file decides and excluding a directory excludes all below it.
+ * uninstall takes no rules and removes every link the package may have
+ * made, so rules given at install time need not be remembered.
  */
 
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <libgen.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #define DEFAULT_PACKAGE_DIR "."
@@ -19,26 +46,475 @@
 
 #define PACKAGE_INFO_FNAME "pkginfo"
 #define PACKAGE_FILES_DIRNAME "pkgfiles"
+#define PACKAGE_DIGEST_FNAME "pkgdigest"
+#define PACKAGE_INDEX_FNAME "pkgindex"
+#define PACKAGE_INDEX_HEADER "mypkg-index 1"
+
+#define STATE_DIR "var/lib/mypkg"
+#define INSTALLED_LIST_FNAME "installed"
+#define INSTALLED_LOCK_FNAME "installed.lock"
+#define TARGET_LOCK_FNAME "lock"
+#define PATH_LOCKS_DIRNAME "locks"
+
+#define BLAKE3_OUT_LEN 32
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+#define BLAKE3_MAX_DEPTH 54
+
+#define HASH_READ_SIZE (1 << 16)
+/* files larger than this are hashed a subtree at a time across threads */
+#define HASH_SUBTREE_SIZE (1 << 20)
+
+#define DIGEST_NAME_OFFSET (2 * BLAKE3_OUT_LEN + 3)
+
+#define FILTER_BASENAME 1
+#define FILTER_LITERAL 2
+#define FILTER_DIR_ONLY 4
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+    | IN_ONLYDIR)
+#define WATCH_BUF_SIZE (1 << 16)
+#define WATCH_SETTLE_MS 20
+#define WATCH_BATCH_MS 250
+#define WATCH_RETRY_MS 1000
+
+struct blake3_chunk_state {
+    uint32_t cv[8];
+    uint64_t chunk_counter;
+    uint8_t block[BLAKE3_BLOCK_LEN];
+    uint8_t block_len;
+    uint8_t blocks_compressed;
+};
+
+struct blake3_hasher {
+    struct blake3_chunk_state chunk;
+    uint32_t cv_stack[BLAKE3_MAX_DEPTH][8];
+    uint8_t cv_stack_len;
+};
+
+/*
+ * a file found under pkgfiles, name is relative to pkgfiles. link holds the
+ * text of symbolic links and is NULL for other types. target_link is the
+ * text of the link install makes for it, set by set_target_link, or NULL.
+ */
+struct pkg_file {
+    char *name;
+    unsigned int type;
+    char *link;
+    char *target_link;
+};
+
+struct pkg_file_list {
+    struct pkg_file *files;
+    size_t count;
+    size_t capacity;
+};
+
+/*
+ * a large file being hashed by several threads. next is the next subtree to
+ * hand out and done counts finished ones, whoever finishes the last merges.
+ */
+struct digest_split {
+    char *file_name;
+    uint8_t *out;
+    int fd;
+    off_t size;
+    size_t count;
+    size_t next;
+    size_t done;
+    int failed;
+    uint32_t (*cvs)[8];
+    struct digest_split *next_split;
+};
+
+/*
+ * splits holds the large files with subtrees left to hand out and opening
+ * counts regular files whose size is not known yet.
+ */
+struct digest_ctx {
+    char *pkgfiles_dir;
+    struct pkg_file_list *list;
+    uint8_t (*digests)[BLAKE3_OUT_LEN];
+    size_t next;
+    struct digest_split *splits;
+    int opening;
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/* real path of the directory links of one target were last made in */
+struct link_dir_cache {
+    char *dir;
+    char *real_dir;
+};
+
+struct filter_rule {
+    char *pattern;
+    int exclude;
+    int flags;
+};
+
+/* include and exclude rules in the order given */
+struct filter {
+    struct filter_rule *rules;
+    size_t count;
+    size_t capacity;
+};
+
+struct install_opts {
+    int jobs;
+    int flatten_links;
+    int wait;
+    struct filter filter;
+};
+
+struct install_ctx {
+    char *real_pkgfiles_dir;
+    char *real_first_dir;
+    struct pkg_file_list *list;
+    struct install_opts *opts;
+    char **install_dirs;
+    int install_count;
+    int next;
+    int failed;
+    pthread_mutex_t lock;
+};
+
+/* a package to uninstall, listed once for every install directory */
+struct listed_pkg {
+    char *pkg_dir;
+    char *real_pkgfiles_dir;
+    struct pkg_file_list list;
+};
+
+/* install directories are shared out between the workers by next */
+struct uninstall_ctx {
+    struct listed_pkg *pkgs;
+    int pkg_count;
+    char **install_dirs;
+    int install_count;
+    struct install_opts *opts;
+    int next;
+    int failed;
+    pthread_mutex_t lock;
+};
+
+struct str_list {
+    char **strs;
+    size_t count;
+    size_t capacity;
+};
+
+struct lock_set {
+    int *fds;
+    size_t count;
+};
+
+/*
+ * files is what is installed from the package, changes the names events were
+ * seen for since they were last applied.
+ */
+struct watch_pkg {
+    char *pkg_dir;
+    char *pkgfiles_dir;
+    char *real_pkgfiles_dir;
+    struct pkg_file_list files;
+    struct pkg_file_list changes;
+    struct filter filter;
+};
+
+/* a watched directory, indexed by its watch descriptor */
+struct watch_dir {
+    int pkg;
+    char *name;
+};
+
+struct watch_ctx {
+    struct watch_pkg *pkgs;
+    int pkg_count;
+    struct watch_dir *dirs;
+    int dir_capacity;
+    char **install_dirs;
+    int install_count;
+    int *lock_fds;
+    struct install_opts *opts;
+    int fd;
+};
+
+/*
+ * a directory being scanned. pending counts its own scan and each
+ * subdirectory queued from it that is not done yet, kept is set when it or a
+ * subdirectory holds dangling links for gc_remove_chains.
+ */
+struct gc_dir {
+    char *name;
+    struct gc_dir *parent;
+    long entries;
+    long removed;
+    int pending;
+    int kept;
+};
+
+/* a kept directory, how many entries it had and how many were removed */
+struct gc_dir_stat {
+    char *name;
+    long entries;
+    long removed;
+};
+
+/*
+ * names are relative to the target. queue holds directories waiting to be
+ * scanned, dirs the kept directories, removed the links removed so far and
+ * dangling the dangling links that do not point into a store.
+ *
+ * a directory is pruned and freed as soon as it and everything below it is
+ * scanned, so memory for the scan grows with the queue and the directories
+ * above it, not with the size of the tree. what outlives the scan grows only
+ * with the dangling links found: their names, the directories holding
+ * dangling links that do not point into a store and the directories above
+ * those. a target with millions of healthy entries keeps none of them.
+ */
+struct gc_ctx {
+    char *target;
+    int dry_run;
+    dev_t dev;
+    int root_fd;
+    struct gc_dir **queue;
+    size_t queue_count;
+    size_t queue_capacity;
+    int active;
+    pthread_cond_t cond;
+    struct gc_dir_stat *dirs;
+    size_t dir_count;
+    size_t dir_capacity;
+    struct str_list removed;
+    struct pkg_file_list dangling;
+    unsigned long links;
+    unsigned long dirs_removed;
+    int failed;
+    pthread_mutex_t lock;
+};
 
 int add_to_buffer(char *new, char *buf, size_t buf_size, int *buf_index);
 int path_common_prefix(char *a, char *b);
 int path_relative(char *src_dir, char *dst_file, char* buf);
+int path_relative_real(char *real_src_dir, char *real_dst_file, char* buf);
 char *remove_prefix(char *prefix, char *string);
 int touch_dir(char *dir);
-int make_relative_link(char *target, char *link_file);
-int copy_link(char *src, char *dst);
+int make_relative_link(char *real_target, char *real_link_dir, char *link_file);
+int copy_link(char *link, char *dst);
+int flatten_link(char *real_pkgfiles_dir, struct pkg_file *file, char *buf);
+char *link_dir_real_path(
+    struct link_dir_cache *cache, char *install_dir, char *file_name);
+int set_target_link(
+    struct pkg_file *file,
+    char *real_pkgfiles_dir,
+    char *real_first_dir,
+    int flatten_links);
+char *shared_link_target(
+    char *install_dir,
+    char *real_first_dir,
+    char *real_pkgfiles_dir,
+    char *buf);
+int path_is_under(char *dir, char *path);
+int make_target_link(
+    struct pkg_file *file,
+    char *install_dir,
+    char *real_install_dir,
+    char *real_pkgfiles_dir,
+    struct link_dir_cache *cache,
+    char *dst_file);
 int find_recursive(
     char *dir_name,
     int (*handle)(char *, unsigned int, void *),
     void *handle_ctx);
 char *str_file_type(unsigned int type);
-int install_file(char *src_file, unsigned int type, void *ctx);
-int uninstall_link(char *src_file, unsigned int type, void *ctx);
-int uninstall_directory(char *src_file, unsigned int type, void *ctx);
-int install_pkg(char *pkg_dir, char *install_dir);
-int uninstall_pkg(char *pkg_dir, char *install_dir);
-int install(char **package_dirs, int package_count, char *install_dir);
-int uninstall(char **package_dirs, int package_count, char *install_dir);
+int install_file(
+    struct pkg_file *file,
+    char *install_dir,
+    char *real_install_dir,
+    char *real_pkgfiles_dir,
+    struct link_dir_cache *cache);
+int uninstall_link(
+    struct pkg_file *file,
+    char *install_dir,
+    char *real_pkgfiles_dir,
+    struct link_dir_cache *cache);
+int uninstall_directory(struct pkg_file *file, char *install_dir);
+int install_pkg_files(struct install_ctx *ctx, char *install_dir);
+void *install_worker(void *ctx);
+int install_pkg(
+    char *pkg_dir,
+    char **install_dirs,
+    int install_count,
+    struct install_opts *opts);
+int load_listed_pkg(char *pkg_dir, struct listed_pkg *pkg);
+void listed_pkg_free(struct listed_pkg *pkg);
+int uninstall_pkg_links(
+    struct listed_pkg *pkg,
+    char *install_dir,
+    struct pkg_file_list *dirs,
+    int wait);
+int prune_dirs(struct pkg_file_list *dirs, char *install_dir, int wait);
+int uninstall_pkg(
+    char *pkg_dir,
+    char **install_dirs,
+    int install_count,
+    struct install_opts *opts);
+int uninstall_target(struct uninstall_ctx *ctx, char *install_dir);
+void *uninstall_worker(void *ctx);
+int install(
+    char **package_dirs,
+    int package_count,
+    char **install_dirs,
+    int install_count,
+    struct install_opts *opts);
+int uninstall(
+    char **package_dirs,
+    int package_count,
+    char **install_dirs,
+    int install_count,
+    struct install_opts *opts);
+void blake3_compress(
+    const uint32_t cv[8],
+    const uint32_t block_words[16],
+    uint64_t counter,
+    uint32_t block_len,
+    uint32_t flags,
+    uint32_t out[16]);
+void blake3_words_from_block(const uint8_t *block, uint32_t *words);
+void blake3_chunk_state_init(struct blake3_chunk_state *self, uint64_t counter);
+size_t blake3_chunk_state_len(const struct blake3_chunk_state *self);
+uint32_t blake3_chunk_state_start_flag(const struct blake3_chunk_state *self);
+void blake3_chunk_state_update(
+    struct blake3_chunk_state *self, const uint8_t *input, size_t input_len);
+void blake3_parent_cv(
+    const uint32_t left[8], const uint32_t right[8], uint32_t out_cv[8]);
+void blake3_hasher_init(struct blake3_hasher *self);
+void blake3_hasher_init_at(struct blake3_hasher *self, uint64_t chunk_counter);
+void blake3_hasher_update(
+    struct blake3_hasher *self, const void *input, size_t input_len);
+void blake3_hasher_output(
+    const struct blake3_hasher *self, uint32_t root_flag, uint32_t state[16]);
+void blake3_hasher_finalize(const struct blake3_hasher *self, uint8_t *out);
+void blake3_hasher_subtree_cv(const struct blake3_hasher *self, uint32_t cv[8]);
+void blake3_state_bytes(const uint32_t state[16], uint8_t *out);
+void blake3_merge_subtrees(uint32_t (*cvs)[8], size_t count, uint8_t *out);
+int pkg_file_list_push(
+    struct pkg_file_list *list,
+    char *name,
+    size_t name_len,
+    unsigned int type,
+    char *link,
+    size_t link_len);
+int pkg_file_list_add(char *src_file, unsigned int type, void *ctx);
+int pkg_file_cmp(const void *a, const void *b);
+void pkg_file_list_free(struct pkg_file_list *list);
+int list_pkg_files(char *pkgfiles_dir, struct pkg_file_list *list);
+int hash_file(char *file_name, unsigned int type, uint8_t *out);
+int hash_fd(int fd, char *file_name, uint8_t *out);
+int digest_split_start(
+    struct digest_ctx *ctx, int fd, off_t size, char *file_name, uint8_t *out);
+void digest_split_piece(
+    struct digest_ctx *ctx, struct digest_split *split, size_t piece);
+int digest_file(struct digest_ctx *ctx, size_t i, char *file_name);
+void *digest_worker(void *ctx);
+int digest_pkg_files(
+    char *pkg_dir,
+    struct pkg_file_list *list,
+    uint8_t (**digests)[BLAKE3_OUT_LEN]);
+void format_digest(uint8_t *digest, char *buf);
+char digest_type_char(unsigned int type);
+int build_pkg_digest(
+    char *pkg_dir, char **body, size_t *body_len, uint8_t *pkg_digest);
+int write_pkg_digest(char *pkg_dir);
+int verify_pkg_digest(char *pkg_dir);
+int digest(char **package_dirs, int package_count);
+int verify(char **package_dirs, int package_count);
+char index_type_char(unsigned int type);
+unsigned int index_char_type(char c);
+int write_pkg_index(char *pkg_dir);
+int index_is_newer(struct stat *index_stat, char *dir);
+int read_pkg_index(
+    char *pkg_dir,
+    char *pkgfiles_dir,
+    struct pkg_file_list *list,
+    int *valid);
+int load_pkg_files(char *pkg_dir, char *pkgfiles_dir, struct pkg_file_list *list);
+int index_pkgs(char **package_dirs, int package_count);
+int filter_add_rule(struct filter *filter, char *pattern, int exclude);
+void filter_free(struct filter *filter);
+int filter_excludes(struct filter *filter, char *name, unsigned int type);
+int filter_excludes_path(struct filter *filter, char *name, unsigned int type);
+int read_pkg_filter(char *pkg_dir, struct filter *base, struct filter *filter);
+int filter_pkg_files(struct filter *filter, struct pkg_file_list *list);
+int load_filtered_pkg_files(
+    char *pkg_dir,
+    char *pkgfiles_dir,
+    struct filter *base,
+    struct pkg_file_list *list);
+int is_store_link(char *link);
+int gc_join(char *dir, char *name, char *buf);
+int gc_remove_link(struct gc_ctx *ctx, char *name, char *link);
+int gc_remove_dir(struct gc_ctx *ctx, char *name, int *gone);
+int gc_queue_dir(struct gc_ctx *ctx, struct gc_dir *parent, char *name);
+int gc_scan_dir(struct gc_ctx *ctx, struct gc_dir *dir_entry);
+int gc_keep_dir(struct gc_ctx *ctx, struct gc_dir *dir);
+void gc_dir_done(struct gc_ctx *ctx, struct gc_dir *dir);
+void *gc_worker(void *ctx);
+int gc_dir_stat_cmp(const void *a, const void *b);
+struct gc_dir_stat *gc_find_parent(struct gc_ctx *ctx, char *name);
+int gc_link_target(char *name, char *link, char *buf);
+int gc_remove_chains(struct gc_ctx *ctx);
+int gc_prune_dirs(struct gc_ctx *ctx);
+int gc(char *target, int dry_run);
+int str_cmp(const void *a, const void *b);
+int str_list_push(struct str_list *list, char *str);
+void str_list_sort(struct str_list *list);
+int str_list_contains(struct str_list *list, char *str);
+void str_list_free(struct str_list *list);
+int read_pkg_list(
+    char *file_name, struct str_list *list, int missing_ok, int resolve);
+int state_path(char *install_dir, char *name, char *buf);
+int take_lock(char *install_dir, char *name, int exclusive, int wait);
+int lock_target(char *install_dir, int exclusive, int wait);
+int path_lock_name(char *key, char *buf);
+int add_path_lock_keys(
+    struct pkg_file *file, struct str_list *shared, struct str_list *exclusive);
+int lock_paths(
+    char *install_dir,
+    struct pkg_file_list *list,
+    int wait,
+    struct lock_set *locks);
+void unlock_paths(struct lock_set *locks);
+int update_installed(
+    char *install_dir,
+    char **added,
+    int added_count,
+    char **removed,
+    int removed_count,
+    int wait);
+int sync_pkgs(char *list_file, char *install_dir, struct install_opts *opts);
+long pkg_file_list_find(struct pkg_file_list *list, char *name);
+void pkg_file_list_remove(struct pkg_file_list *list, size_t i);
+int watch_add(struct watch_ctx *ctx, int pkg, char *name);
+int watch_scan_file(char *src_file, unsigned int type, void *ctx);
+int watch_add_tree(struct watch_ctx *ctx, int pkg, char *name);
+int watch_read(struct watch_ctx *ctx, char *buf, int *overflow);
+int watch_remove(struct watch_ctx *ctx, struct watch_pkg *pkg, long i);
+int watch_install(
+    struct watch_ctx *ctx, int pkg_index, char *name, struct stat *st);
+int watch_apply(struct watch_ctx *ctx, int pkg_index);
+int watch_resync(struct watch_ctx *ctx);
+int watch_lock(struct watch_ctx *ctx);
+void watch_unlock(struct watch_ctx *ctx);
+int watch(
+    char **package_dirs,
+    int package_count,
+    char **install_dirs,
+    int install_count,
+    struct install_opts *opts);
 
 int
 add_to_buffer(char *new, char *buf, size_t buf_size, int *buf_index)
@@ -80,7 +556,6 @@ int
 path_relative(char *src_dir, char *dst_file, char* buf)
 {
     int ret = 0;
-    int common_prefix, buf_i, i;
     char *real_src_dir, *real_dst_file;
     real_src_dir = malloc(PATH_MAX);
     real_dst_file = malloc(PATH_MAX);
@@ -102,6 +577,33 @@ path_relative(char *src_dir, char *dst_file, char* buf)
         ret = 1;
         goto cleanup;
     }
+    if(path_relative_real(real_src_dir, real_dst_file, buf)) {
+        ret = 1;
+        goto cleanup;
+    }
+
+cleanup:
+    free(real_src_dir);
+    free(real_dst_file);
+    return ret;
+}
+
+/*
+ * like path_relative but both paths must already be real, so no filesystem
+ * access is needed.
+ */
+int
+path_relative_real(char *real_src_dir, char *real_dst_file, char* buf)
+{
+    int ret = 0;
+    int common_prefix, buf_i, i;
+    char *src_dir;
+    src_dir = malloc(PATH_MAX);
+    if(src_dir == NULL) {
+        perror("malloc failed");
+        ret = 1;
+        goto cleanup;
+    }
 
     /* add slash to end of real_src_dir */
     i = strlen(real_src_dir);
@@ -110,15 +612,16 @@ path_relative(char *src_dir, char *dst_file, char* buf)
         ret = 1;
         goto cleanup;
     }
-    real_src_dir[i] = '/';
-    real_src_dir[i + 1] = '\0';
+    strcpy(src_dir, real_src_dir);
+    src_dir[i] = '/';
+    src_dir[i + 1] = '\0';
 
-    common_prefix = path_common_prefix(real_src_dir, real_dst_file);
+    common_prefix = path_common_prefix(src_dir, real_dst_file);
 
     buf_i = 0;
     i = common_prefix + 1;
-    while(real_src_dir[i]) {
-        if(real_src_dir[i] == '/')
+    while(src_dir[i]) {
+        if(src_dir[i] == '/')
             if(add_to_buffer("../", buf, PATH_MAX - 1, &buf_i)) {
                 fprintf(stderr, "relative path name exceeds PATH_MAX\n");
                 ret = 1;
@@ -136,8 +639,7 @@ path_relative(char *src_dir, char *dst_file, char* buf)
     buf[buf_i] = '\0';
 
 cleanup:
-    free(real_src_dir);
-    free(real_dst_file);
+    free(src_dir);
     return ret;
 }
 
@@ -158,18 +660,16 @@ remove_prefix(char *prefix, char *string)
 int
 touch_dir(char *dir)
 {
-    /* check status of dir */
+    /* make dir first so a concurrent mypkg making it too is not an error */
     struct stat dir_stat;
+    if(mkdir(dir, 0755) == 0)
+        return 0;
+    if(errno != EEXIST) {
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to make directory '%s' (%s)\n", dir, err);
+        return 1;
+    }
     if(stat(dir, &dir_stat)) {
-        /* if dir does not exist make it */
-        if(errno == ENOENT) {
-            if(mkdir(dir, 0755)) {
-                char *err = strerror(errno);
-                fprintf(stderr, "failed to make directory '%s' (%s)\n", dir, err);
-                return 1;
-            }
-            return 0;
-        }
         char *err = strerror(errno);
         fprintf(stderr, "failed to stat file '%s' (%s)\n", dir, err);
         return 1;
@@ -188,25 +688,17 @@ touch_dir(char *dir)
 }
 
 int
-make_relative_link(char *target, char *link_file)
+make_relative_link(char *real_target, char *real_link_dir, char *link_file)
 {
     int ret = 0;
-    char *link_file_copy, *rel_path, *link_dir;
-    link_file_copy = malloc(PATH_MAX);
+    char *rel_path;
     rel_path = malloc(PATH_MAX);
-    if(rel_path == NULL || link_file_copy == NULL) {
+    if(rel_path == NULL) {
         perror("malloc failed");
         ret = 1;
         goto cleanup;
     }
-    if(strlen(link_file) >= PATH_MAX) {
-        fprintf(stderr, "file exceeds PATH_MAX '%s'\n", link_file);
-        ret = 1;
-        goto cleanup;
-    }
-    strcpy(link_file_copy, link_file);
-    link_dir = dirname(link_file_copy);
-    if(path_relative(link_dir, target, rel_path)) {
+    if(path_relative_real(real_link_dir, real_target, rel_path)) {
         ret = 1;
         goto cleanup;
     }
@@ -219,40 +711,262 @@ make_relative_link(char *target, char *link_file)
         goto cleanup;
     }
 cleanup:
-    free(link_file_copy);
     free(rel_path);
     return ret;
 }
 
 int
-copy_link(char *src, char *dst)
+copy_link(char *link, char *dst)
+{
+    if(symlink(link, dst)) {
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to create symlink '%s': %s\n", dst, err);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * follow a symbolic link of a package to the end of its chain. if that is a
+ * regular file of the same package its real path is written to buf and 1 is
+ * returned, otherwise the link is not flattened and 0 is returned.
+ */
+int
+flatten_link(char *real_pkgfiles_dir, struct pkg_file *file, char *buf)
+{
+    int flat = 0;
+    char *src_file, *name;
+    struct stat st;
+
+    src_file = malloc(PATH_MAX);
+    if(src_file == NULL) {
+        perror("malloc failed");
+        return 0;
+    }
+    if(snprintf(src_file, PATH_MAX, "%s/%s", real_pkgfiles_dir, file->name)
+            >= PATH_MAX)
+        goto cleanup;
+    if(realpath(src_file, buf) == NULL)
+        goto cleanup;
+    name = remove_prefix(real_pkgfiles_dir, buf);
+    if(name == NULL || *name != '/')
+        goto cleanup;
+    if(stat(buf, &st) || !S_ISREG(st.st_mode))
+        goto cleanup;
+    flat = 1;
+cleanup:
+    free(src_file);
+    return flat;
+}
+
+/*
+ * get the real path of the directory in install_dir that file is linked
+ * into. files come sorted by name, so consecutive files mostly share a
+ * directory and the realpath call is made once per directory.
+ */
+char *
+link_dir_real_path(
+    struct link_dir_cache *cache, char *install_dir, char *file_name)
+{
+    char *slash, *link_dir;
+    size_t dir_len;
+
+    slash = strrchr(file_name, '/');
+    dir_len = slash == NULL ? 0 : slash - file_name;
+    if(cache->real_dir[0] != '\0' && strlen(cache->dir) == dir_len
+            && strncmp(cache->dir, file_name, dir_len) == 0)
+        return cache->real_dir;
+
+    link_dir = malloc(PATH_MAX);
+    if(link_dir == NULL) {
+        perror("malloc failed");
+        return NULL;
+    }
+    if(snprintf(link_dir, PATH_MAX, "%s/%.*s", install_dir, (int)dir_len,
+            file_name) >= PATH_MAX) {
+        fprintf(stderr, "path exceeds PATH_MAX somewhere in '%s'\n",
+            install_dir);
+        free(link_dir);
+        return NULL;
+    }
+    if(realpath(link_dir, cache->real_dir) == NULL) {
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to get real path of '%s': %s\n", link_dir, err);
+        cache->dir[0] = cache->real_dir[0] = '\0';
+        free(link_dir);
+        return NULL;
+    }
+    memcpy(cache->dir, file_name, dir_len);
+    cache->dir[dir_len] = '\0';
+    free(link_dir);
+    return cache->real_dir;
+}
+
+/*
+ * work out the text of the link made for file in the first target, whose
+ * real path is real_first_dir, if the file is linked into the package:
+ * regular files and, when flattening, links whose chain ends at one. the
+ * text is worked out from names alone, install_file checks it still holds.
+ */
+int
+set_target_link(
+    struct pkg_file *file,
+    char *real_pkgfiles_dir,
+    char *real_first_dir,
+    int flatten_links)
 {
     int ret = 0;
-    int link_len;
-    char *link;
+    char *slash, *real_src_file, *link_dir, *text;
 
-    link = malloc(PATH_MAX);
-    if(link == NULL) {
-        perror("malloc failed\n");
+    real_src_file = malloc(PATH_MAX);
+    link_dir = malloc(PATH_MAX);
+    text = malloc(PATH_MAX);
+    if(real_src_file == NULL || link_dir == NULL || text == NULL) {
+        perror("malloc failed");
         ret = 1;
         goto cleanup;
     }
-    link_len = readlink(src, link, PATH_MAX - 1);
-    if(link_len < 0) {
-        char *err = strerror(errno);
-        fprintf(stderr, "failed to read link of '%s': %s\n", src, err);
+
+    if(file->type == DT_REG) {
+        if(snprintf(real_src_file, PATH_MAX, "%s/%s", real_pkgfiles_dir,
+                file->name) >= PATH_MAX) {
+            fprintf(stderr, "path exceeds PATH_MAX somewhere in '%s'\n",
+                real_pkgfiles_dir);
+            ret = 1;
+            goto cleanup;
+        }
+    } else if(file->type != DT_LNK || !flatten_links
+        || !flatten_link(real_pkgfiles_dir, file, real_src_file)) {
+        goto cleanup;
+    }
+
+    slash = strrchr(file->name, '/');
+    if(snprintf(link_dir, PATH_MAX, "%s%s%.*s", real_first_dir,
+            slash == NULL ? "" : "/",
+            slash == NULL ? 0 : (int)(slash - file->name), file->name)
+            >= PATH_MAX) {
+        fprintf(stderr, "path exceeds PATH_MAX somewhere in '%s'\n",
+            real_first_dir);
         ret = 1;
         goto cleanup;
     }
-    link[link_len] = '\0';
-    if(symlink(link, dst)) {
-        char *err = strerror(errno);
-        fprintf(stderr, "failed to create symlink '%s': %s\n", dst, err);
+    if(path_relative_real(link_dir, real_src_file, text)) {
+        ret = 1;
+        goto cleanup;
+    }
+    file->target_link = strdup(text);
+    if(file->target_link == NULL) {
+        perror("strdup failed");
         ret = 1;
         goto cleanup;
     }
+
 cleanup:
-    free(link);
+    free(real_src_file);
+    free(link_dir);
+    free(text);
+    return ret;
+}
+
+/*
+ * link text worked out for the first target holds in install_dir too if it
+ * is the first target or sits in the same directory, and the package is in
+ * neither. its real path is written to buf and returned if so, else NULL.
+ */
+char *
+shared_link_target(
+    char *install_dir,
+    char *real_first_dir,
+    char *real_pkgfiles_dir,
+    char *buf)
+{
+    char *first_slash, *slash;
+
+    if(realpath(install_dir, buf) == NULL)
+        return NULL;
+    if(strcmp(buf, real_first_dir) == 0)
+        return buf;
+    first_slash = strrchr(real_first_dir, '/');
+    slash = strrchr(buf, '/');
+    if(first_slash - real_first_dir != slash - buf
+        || strncmp(real_first_dir, buf, slash - buf) != 0
+        || path_is_under(real_first_dir, real_pkgfiles_dir)
+        || path_is_under(buf, real_pkgfiles_dir))
+        return NULL;
+    return buf;
+}
+
+int
+path_is_under(char *dir, char *path)
+{
+    size_t len = strlen(dir);
+
+    return strncmp(dir, path, len) == 0
+        && (path[len] == '/' || path[len] == '\0' || dir[len - 1] == '/');
+}
+
+/*
+ * make the link of a file install_pkg worked out the text of. the text is
+ * used as is if the link directory really is where set_target_link took it
+ * to be, otherwise it is worked out again for this target.
+ */
+int
+make_target_link(
+    struct pkg_file *file,
+    char *install_dir,
+    char *real_install_dir,
+    char *real_pkgfiles_dir,
+    struct link_dir_cache *cache,
+    char *dst_file)
+{
+    int ret = 0;
+    size_t len, dir_len;
+    char *slash, *real_dst_dir, *real_src_file;
+
+    real_src_file = NULL;
+    real_dst_dir = link_dir_real_path(cache, install_dir, file->name);
+    if(real_dst_dir == NULL)
+        return 1;
+    if(real_install_dir != NULL) {
+        len = strlen(real_install_dir);
+        slash = strrchr(file->name, '/');
+        dir_len = slash == NULL ? 0 : slash - file->name;
+        if(strncmp(real_dst_dir, real_install_dir, len) == 0
+            && (dir_len == 0 ? real_dst_dir[len] == '\0'
+                : real_dst_dir[len] == '/'
+                    && strncmp(&real_dst_dir[len + 1], file->name, dir_len)
+                        == 0
+                    && real_dst_dir[len + 1 + dir_len] == '\0'))
+            return copy_link(file->target_link, dst_file);
+    }
+
+    real_src_file = malloc(PATH_MAX);
+    if(real_src_file == NULL) {
+        perror("malloc failed");
+        ret = 1;
+        goto cleanup;
+    }
+    if(file->type == DT_REG) {
+        if(snprintf(real_src_file, PATH_MAX, "%s/%s", real_pkgfiles_dir,
+                file->name) >= PATH_MAX) {
+            fprintf(stderr, "path exceeds PATH_MAX somewhere in '%s'\n",
+                real_pkgfiles_dir);
+            ret = 1;
+            goto cleanup;
+        }
+    } else if(!flatten_link(real_pkgfiles_dir, file, real_src_file)) {
+        fprintf(stderr, "link '%s' no longer ends at a file of the package\n",
+            file->name);
+        ret = 1;
+        goto cleanup;
+    }
+    if(make_relative_link(real_src_file, real_dst_dir, dst_file)) {
+        ret = 1;
+        goto cleanup;
+    }
+
+cleanup:
+    free(real_src_file);
     return ret;
 }
 
@@ -340,15 +1054,20 @@ str_file_type(unsigned int type)
     }
 }
 
+/*
+ * install one file into install_dir. real_install_dir is its real path if
+ * the link text in file->target_link may be used there, or NULL.
+ */
 int
-install_file(char *src_file, unsigned int type, void *ctx)
+install_file(
+    struct pkg_file *file,
+    char *install_dir,
+    char *real_install_dir,
+    char *real_pkgfiles_dir,
+    struct link_dir_cache *cache)
 {
     int ret = 0;
-    char *src_dir, *dst_dir;
-    char *file_name, *dst_file;
-
-    src_dir = ((char **)ctx)[0];
-    dst_dir = ((char **)ctx)[1];
+    char *dst_file;
 
     dst_file = malloc(PATH_MAX);
     if(dst_file == NULL) {
@@ -357,21 +1076,15 @@ install_file(char *src_file, unsigned int type, void *ctx)
         goto cleanup;
     }
 
-    file_name = remove_prefix(src_dir, src_file);
-    if(file_name == NULL) {
-        fprintf(stderr, "src_file does not begin with src_dir\n");
-        ret = 1;
-        goto cleanup;
-    }
-    while(*file_name == '/') file_name++;
-
-    if(snprintf(dst_file, PATH_MAX, "%s/%s", dst_dir, file_name) >= PATH_MAX) {
-        fprintf(stderr, "path exceeds PATH_MAX somewhere in '%s'\n", dst_dir);
+    if(snprintf(dst_file, PATH_MAX, "%s/%s", install_dir, file->name)
+            >= PATH_MAX) {
+        fprintf(stderr,
+            "path exceeds PATH_MAX somewhere in '%s'\n", install_dir);
         ret = 1;
         goto cleanup;
     }
 
-    switch(type) {
+    switch(file->type) {
     case DT_DIR:
         if(touch_dir(dst_file)) {
             fprintf(stderr, "failed to create directory '%s'\n", dst_file);
@@ -380,14 +1093,30 @@ install_file(char *src_file, unsigned int type, void *ctx)
         }
         break;
     case DT_LNK:
-        if(copy_link(src_file, dst_file)) {
+        /* flattened, link straight to the file the chain ends at */
+        if(file->target_link != NULL) {
+            if(make_target_link(file, install_dir, real_install_dir,
+                    real_pkgfiles_dir, cache, dst_file)) {
+                fprintf(stderr, "failed to make link '%s'\n", dst_file);
+                ret = 1;
+                goto cleanup;
+            }
+            break;
+        }
+        if(copy_link(file->link, dst_file)) {
             fprintf(stderr, "failed to copy link to '%s'\n", dst_file);
             ret = 1;
             goto cleanup;
         }
         break;
     case DT_REG:
-        if(make_relative_link(src_file, dst_file)) {
+        if(file->target_link == NULL) {
+            fprintf(stderr, "no link worked out for '%s'\n", file->name);
+            ret = 1;
+            goto cleanup;
+        }
+        if(make_target_link(file, install_dir, real_install_dir,
+                real_pkgfiles_dir, cache, dst_file)) {
             fprintf(stderr, "failed to make link '%s'\n", dst_file);
             ret = 1;
             goto cleanup;
@@ -399,7 +1128,7 @@ install_file(char *src_file, unsigned int type, void *ctx)
         break;
     default:
         fprintf(stderr, "install does not support %s. skipping\n",
-            str_file_type(type));
+            str_file_type(file->type));
         break;
     }
 
@@ -409,53 +1138,39 @@ cleanup:
 }
 
 int
-uninstall_link(char *src_file, unsigned int type, void *ctx)
+uninstall_link(
+    struct pkg_file *file,
+    char *install_dir,
+    char *real_pkgfiles_dir,
+    struct link_dir_cache *cache)
 {
     int ret = 0;
     int link_len;
-    char *src_dir, *dst_dir, *file_name;
-    char *dst_file, *dst_file_dir, *correct_link, *found_link;
-
-    src_dir = ((char **)ctx)[0];
-    dst_dir = ((char **)ctx)[1];
+    char *dst_file, *real_src_file, *real_dst_dir, *correct_link, *found_link;
 
     dst_file = malloc(PATH_MAX);
+    real_src_file = malloc(PATH_MAX);
     correct_link = malloc(PATH_MAX);
     found_link = malloc(PATH_MAX);
-    dst_file_dir = malloc(PATH_MAX);
-    if(dst_file == NULL || correct_link == NULL || found_link == NULL
-        || dst_file_dir == NULL) {
+    if(dst_file == NULL || real_src_file == NULL || correct_link == NULL
+        || found_link == NULL) {
         ret = 1;
         perror("malloc failed");
         goto cleanup;
     }
 
-    file_name = remove_prefix(src_dir, src_file);
-    if(file_name == NULL) {
-        fprintf(stderr, "src_file does not begin with src_dir\n");
-        ret = 1;
-        goto cleanup;
-    }
-    while(*file_name == '/') file_name++;
-
-    if(snprintf(dst_file, PATH_MAX, "%s/%s", dst_dir, file_name) >= PATH_MAX) {
-        fprintf(stderr, "path exceeds PATH_MAX somewhere in '%s'\n", dst_dir);
+    if(snprintf(dst_file, PATH_MAX, "%s/%s", install_dir, file->name)
+            >= PATH_MAX) {
+        fprintf(stderr,
+            "path exceeds PATH_MAX somewhere in '%s'\n", install_dir);
         ret = 1;
         goto cleanup;
     }
 
-    switch(type) {
+    switch(file->type) {
     case DT_DIR:
         break;
     case DT_LNK:
-        link_len = readlink(src_file, correct_link, PATH_MAX - 1);
-        if(link_len < 0) {
-            char *err = strerror(errno);
-            fprintf(stderr, "failed to read link of '%s': %s\n", src_file, err);
-            ret = 1;
-            goto cleanup;
-        }
-        correct_link[link_len] = '\0';
         link_len = readlink(dst_file, found_link, PATH_MAX - 1);
         if(link_len < 0) {
             if(errno == ENOENT)
@@ -466,9 +1181,22 @@ uninstall_link(char *src_file, unsigned int type, void *ctx)
             goto cleanup;
         }
         found_link[link_len] = '\0';
-        if(strcmp(correct_link, found_link) != 0) {
-            printf("link does not match, skipping '%s'\n", dst_file);
-            break;
+        /* the link may have been flattened when installed */
+        if(strcmp(file->link, found_link) != 0) {
+            if(!flatten_link(real_pkgfiles_dir, file, real_src_file)) {
+                printf("link does not match, skipping '%s'\n", dst_file);
+                break;
+            }
+            real_dst_dir = link_dir_real_path(cache, install_dir, file->name);
+            if(real_dst_dir == NULL || path_relative_real(real_dst_dir,
+                    real_src_file, correct_link)) {
+                ret = 1;
+                goto cleanup;
+            }
+            if(strcmp(correct_link, found_link) != 0) {
+                printf("link does not match, skipping '%s'\n", dst_file);
+                break;
+            }
         }
         if(remove(dst_file)) {
             char *err = strerror(errno);
@@ -487,9 +1215,16 @@ uninstall_link(char *src_file, unsigned int type, void *ctx)
             goto cleanup;
         }
         found_link[link_len] = '\0';
-        strcpy(dst_file_dir, dst_file);
-        dirname(dst_file_dir);
-        if(path_relative(dst_file_dir, src_file, correct_link)) {
+        if(snprintf(real_src_file, PATH_MAX, "%s/%s", real_pkgfiles_dir,
+                file->name) >= PATH_MAX) {
+            fprintf(stderr, "path exceeds PATH_MAX somewhere in '%s'\n",
+                real_pkgfiles_dir);
+            ret = 1;
+            goto cleanup;
+        }
+        real_dst_dir = link_dir_real_path(cache, install_dir, file->name);
+        if(real_dst_dir == NULL
+            || path_relative_real(real_dst_dir, real_src_file, correct_link)) {
             ret = 1;
             goto cleanup;
         }
@@ -511,31 +1246,30 @@ uninstall_link(char *src_file, unsigned int type, void *ctx)
         break;
     default:
         fprintf(stderr, "uninstall does not support %s. skipping\n",
-            str_file_type(type));
+            str_file_type(file->type));
         break;
     }
 
 cleanup:
     free(dst_file);
+    free(real_src_file);
     free(correct_link);
     free(found_link);
-    free(dst_file_dir);
     return ret;
 }
 
+/*
+ * directories still holding files, or that are links to directories made by
+ * someone else, are left in place.
+ */
 int
-uninstall_directory(char *src_file, unsigned int type, void *ctx)
+uninstall_directory(struct pkg_file *file, char *install_dir)
 {
-    int ret, link_len, *done;
-    char *src_dir, *dst_dir, *file_name, *dst_file;
-    struct { char *src; char *dst; int done; } *cast_ctx;
-
-    ret = 0;
-    cast_ctx = ctx;
+    int ret = 0;
+    char *dst_file;
 
-    src_dir = cast_ctx->src;
-    dst_dir = cast_ctx->dst;
-    done = &cast_ctx->done;
+    if(file->type != DT_DIR)
+        return 0;
 
     dst_file = malloc(PATH_MAX);
     if(dst_file == NULL) {
@@ -544,63 +1278,121 @@ uninstall_directory(char *src_file, unsigned int type, void *ctx)
         goto cleanup;
     }
 
-    file_name = remove_prefix(src_dir, src_file);
-    if(file_name == NULL) {
-        fprintf(stderr, "src_file does not begin with src_dir\n");
+    if(snprintf(dst_file, PATH_MAX, "%s/%s", install_dir, file->name)
+            >= PATH_MAX) {
+        fprintf(stderr,
+            "path exceeds PATH_MAX somewhere in '%s'\n", install_dir);
         ret = 1;
         goto cleanup;
     }
-    while(*file_name == '/') file_name++;
 
-    if(snprintf(dst_file, PATH_MAX, "%s/%s", dst_dir, file_name) >= PATH_MAX) {
-        fprintf(stderr, "path exceeds PATH_MAX somewhere in '%s'\n", dst_dir);
+    if(rmdir(dst_file)) {
+        if(errno == ENOTEMPTY || errno == ENOENT || errno == ENOTDIR
+            || errno == EEXIST)
+            goto cleanup;
+        char *err = strerror(errno);
+        fprintf(stderr,
+            "failed to remove directory '%s': %s\n", dst_file, err);
         ret = 1;
         goto cleanup;
     }
 
-    switch(type) {
-    case DT_DIR:
-        if(rmdir(dst_file)) {
-            if(errno == ENOTEMPTY || errno == ENOENT)
-                break;
-            char *err = strerror(errno);
-            fprintf(stderr,
-                "failed to remove directory '%s': %s\n", dst_file, err);
-            ret = 1;
-            goto cleanup;
-        } else {
-            *done = 0;
-        }
-        break;
-    case DT_LNK:
-        break;
-    case DT_REG:
-        break;
-    case DT_UNKNOWN:
-        fprintf(stderr,
-            "unknown file type. filesystem not supported. skipping\n");
-        break;
-    default:
-        fprintf(stderr, "uninstall does not support %s. skipping\n",
-            str_file_type(type));
-        break;
+cleanup:
+    free(dst_file);
+    return ret;
+}
+
+int
+install_pkg_files(struct install_ctx *ctx, char *install_dir)
+{
+    int ret = 0;
+    char *real_install_dir, *buf;
+    struct link_dir_cache cache;
+    struct lock_set locks = {0};
+
+    buf = malloc(PATH_MAX);
+    cache.dir = malloc(PATH_MAX);
+    cache.real_dir = malloc(PATH_MAX);
+    if(buf == NULL || cache.dir == NULL || cache.real_dir == NULL) {
+        perror("malloc failed");
+        ret = 1;
+        goto cleanup;
+    }
+    cache.dir[0] = cache.real_dir[0] = '\0';
+
+    if(lock_paths(install_dir, ctx->list, ctx->opts->wait, &locks)) {
+        ret = 1;
+        goto cleanup;
     }
+    real_install_dir = shared_link_target(install_dir, ctx->real_first_dir,
+        ctx->real_pkgfiles_dir, buf);
+    for(size_t i = 0; i < ctx->list->count; i++)
+        if(install_file(&ctx->list->files[i], install_dir, real_install_dir,
+                ctx->real_pkgfiles_dir, &cache)) {
+            ret = 1;
+            goto cleanup;
+        }
 
 cleanup:
-    free(dst_file);
+    unlock_paths(&locks);
+    free(buf);
+    free(cache.dir);
+    free(cache.real_dir);
     return ret;
 }
 
+/* install directories are shared out between the workers */
+void *
+install_worker(void *ctx)
+{
+    struct install_ctx *ictx = ctx;
+    int i;
+
+    for(;;) {
+        pthread_mutex_lock(&ictx->lock);
+        i = ictx->next++;
+        pthread_mutex_unlock(&ictx->lock);
+        if(i >= ictx->install_count)
+            break;
+        if(install_pkg_files(ictx, ictx->install_dirs[i])) {
+            fprintf(stderr, "failed to install files to '%s'\n",
+                ictx->install_dirs[i]);
+            pthread_mutex_lock(&ictx->lock);
+            ictx->failed = 1;
+            pthread_mutex_unlock(&ictx->lock);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * the package is listed once and every install directory is populated from
+ * that listing, by up to jobs threads. the link text of each file is worked
+ * out once, for the first install directory, and reused by the others.
+ */
 int
-install_pkg(char *pkg_dir, char *install_dir)
+install_pkg(
+    char *pkg_dir,
+    char **install_dirs,
+    int install_count,
+    struct install_opts *opts)
 {
     int ret = 0;
+    int jobs, started;
     char *pkgfiles_dir;
+    pthread_t *threads;
+    struct pkg_file_list list = {0};
+    struct install_ctx ctx;
 
     printf("installing '%s'\n", pkg_dir);
 
+    threads = NULL;
+    pthread_mutex_init(&ctx.lock, NULL);
     pkgfiles_dir = malloc(PATH_MAX);
-    if(pkgfiles_dir == NULL) {
+    ctx.real_pkgfiles_dir = malloc(PATH_MAX);
+    ctx.real_first_dir = malloc(PATH_MAX);
+    if(pkgfiles_dir == NULL || ctx.real_pkgfiles_dir == NULL
+        || ctx.real_first_dir == NULL) {
         perror("malloc failed");
         ret = 1;
         goto cleanup;
@@ -613,30 +1405,93 @@ install_pkg(char *pkg_dir, char *install_dir)
         ret = 1;
         goto cleanup;
     }
-    char *ctx[2];
-    ctx[0] = pkgfiles_dir;
-    ctx[1] = install_dir;
-    if(find_recursive(pkgfiles_dir, install_file, &ctx)) {
-        fprintf(stderr, "failed to install files from '%s' to '%s'\n", pkgfiles_dir, install_dir);
+    if(realpath(pkgfiles_dir, ctx.real_pkgfiles_dir) == NULL) {
+        char *err = strerror(errno);
+        fprintf(stderr,
+            "failed to get real path of '%s': %s\n", pkgfiles_dir, err);
+        ret = 1;
+        goto cleanup;
+    }
+    if(load_filtered_pkg_files(pkg_dir, pkgfiles_dir, &opts->filter, &list)) {
+        ret = 1;
+        goto cleanup;
+    }
+    if(realpath(install_dirs[0], ctx.real_first_dir) == NULL) {
+        char *err = strerror(errno);
+        fprintf(stderr,
+            "failed to get real path of '%s': %s\n", install_dirs[0], err);
+        ret = 1;
+        goto cleanup;
+    }
+    for(size_t i = 0; i < list.count; i++)
+        if(set_target_link(&list.files[i], ctx.real_pkgfiles_dir,
+                ctx.real_first_dir, opts->flatten_links)) {
+            ret = 1;
+            goto cleanup;
+        }
+
+    ctx.list = &list;
+    ctx.opts = opts;
+    ctx.install_dirs = install_dirs;
+    ctx.install_count = install_count;
+    ctx.next = 0;
+    ctx.failed = 0;
+
+    jobs = opts->jobs;
+    if(jobs > install_count)
+        jobs = install_count;
+    if(jobs > 1) {
+        threads = malloc(jobs * sizeof(*threads));
+        if(threads == NULL) {
+            perror("malloc failed");
+            ret = 1;
+            goto cleanup;
+        }
+    }
+    for(started = 0; started < jobs && jobs > 1; started++)
+        if(pthread_create(&threads[started], NULL, install_worker, &ctx)) {
+            fprintf(stderr, "failed to create install thread\n");
+            break;
+        }
+    if(started == 0)
+        install_worker(&ctx);
+    for(int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    if(ctx.failed) {
+        fprintf(stderr,
+            "failed to install files from '%s'\n", pkgfiles_dir);
         ret = 1;
         goto cleanup;
     }
 
 cleanup:
+    pthread_mutex_destroy(&ctx.lock);
+    pkg_file_list_free(&list);
     free(pkgfiles_dir);
+    free(ctx.real_pkgfiles_dir);
+    free(ctx.real_first_dir);
+    free(threads);
     return ret;
 }
 
+/*
+ * list every file of a package to uninstall. no include or exclude rules
+ * apply, every file is tried whatever rules it was installed with and links
+ * that were never made are skipped.
+ */
 int
-uninstall_pkg(char *pkg_dir, char *install_dir)
+load_listed_pkg(char *pkg_dir, struct listed_pkg *pkg)
 {
     int ret = 0;
     char *pkgfiles_dir;
 
     printf("uninstalling '%s'\n", pkg_dir);
 
+    memset(pkg, 0, sizeof(*pkg));
+    pkg->pkg_dir = pkg_dir;
     pkgfiles_dir = malloc(PATH_MAX);
-    if(pkgfiles_dir == NULL) {
+    pkg->real_pkgfiles_dir = malloc(PATH_MAX);
+    if(pkgfiles_dir == NULL || pkg->real_pkgfiles_dir == NULL) {
         perror("malloc failed");
         ret = 1;
         goto cleanup;
@@ -649,100 +1504,4038 @@ uninstall_pkg(char *pkg_dir, char *install_dir)
         ret = 1;
         goto cleanup;
     }
+    if(realpath(pkgfiles_dir, pkg->real_pkgfiles_dir) == NULL) {
+        char *err = strerror(errno);
+        fprintf(stderr,
+            "failed to get real path of '%s': %s\n", pkgfiles_dir, err);
+        ret = 1;
+        goto cleanup;
+    }
+    if(load_pkg_files(pkg_dir, pkgfiles_dir, &pkg->list)) {
+        ret = 1;
+        goto cleanup;
+    }
 
-    struct {char *src; char *dst; int done; } ctx;
-    ctx.src = pkgfiles_dir;
-    ctx.dst = install_dir;
+cleanup:
+    free(pkgfiles_dir);
+    if(ret)
+        listed_pkg_free(pkg);
+    return ret;
+}
+
+void
+listed_pkg_free(struct listed_pkg *pkg)
+{
+    free(pkg->real_pkgfiles_dir);
+    pkg->real_pkgfiles_dir = NULL;
+    pkg_file_list_free(&pkg->list);
+}
+
+/*
+ * remove the links of a listed package from install_dir. its directories
+ * are added to dirs, to be removed by prune_dirs once they may be empty.
+ */
+int
+uninstall_pkg_links(
+    struct listed_pkg *pkg,
+    char *install_dir,
+    struct pkg_file_list *dirs,
+    int wait)
+{
+    int ret = 0;
+    struct pkg_file *file;
+    struct link_dir_cache cache;
+    struct lock_set locks = {0};
 
-    if(find_recursive(pkgfiles_dir, uninstall_link, &ctx)) {
-        fprintf(stderr, "failed to uninstall files from '%s'\n", install_dir);
+    cache.dir = malloc(PATH_MAX);
+    cache.real_dir = malloc(PATH_MAX);
+    if(cache.dir == NULL || cache.real_dir == NULL) {
+        perror("malloc failed");
         ret = 1;
         goto cleanup;
     }
-    do {
-        ctx.done = 1;
-        if(find_recursive(pkgfiles_dir, uninstall_directory, &ctx)) {
+    cache.dir[0] = cache.real_dir[0] = '\0';
+
+    if(lock_paths(install_dir, &pkg->list, wait, &locks)) {
+        ret = 1;
+        goto cleanup;
+    }
+
+    for(size_t i = 0; i < pkg->list.count; i++) {
+        file = &pkg->list.files[i];
+        if(uninstall_link(file, install_dir, pkg->real_pkgfiles_dir,
+                &cache)) {
+            fprintf(stderr,
+                "failed to uninstall files from '%s'\n", install_dir);
+            ret = 1;
+            goto cleanup;
+        }
+        if(file->type == DT_DIR && pkg_file_list_push(dirs, file->name,
+                strlen(file->name), DT_DIR, NULL, 0)) {
+            ret = 1;
+            goto cleanup;
+        }
+    }
+
+cleanup:
+    unlock_paths(&locks);
+    free(cache.dir);
+    free(cache.real_dir);
+    return ret;
+}
+
+/*
+ * remove the directories of any number of uninstalled packages that are now
+ * empty. sorted, children come after their parent, so one reverse pass
+ * removes whole emptied trees and shared directories are tried once.
+ */
+int
+prune_dirs(struct pkg_file_list *dirs, char *install_dir, int wait)
+{
+    int ret = 0;
+    int fd;
+    char *lock_name;
+    struct pkg_file *dir;
+    struct lock_set locks = {0};
+
+    lock_name = malloc(PATH_MAX);
+    if(lock_name == NULL) {
+        perror("malloc failed");
+        return 1;
+    }
+    qsort(dirs->files, dirs->count, sizeof(*dirs->files), pkg_file_cmp);
+    if(lock_paths(install_dir, dirs, wait, &locks)) {
+        ret = 1;
+        goto cleanup;
+    }
+    for(size_t i = dirs->count; i > 0; i--) {
+        dir = &dirs->files[i - 1];
+        if(i < dirs->count && strcmp(dir->name, dirs->files[i].name) == 0)
+            continue;
+        if(strchr(dir->name, '/') == NULL)
+            continue;
+        if(uninstall_directory(dir, install_dir)) {
             fprintf(stderr, "failed to uninstall directories from '%s'\n",
                 install_dir);
             ret = 1;
             goto cleanup;
         }
-    } while(ctx.done == 0);
+    }
+    unlock_paths(&locks);
+
+    /*
+     * other processes hold top level directories shared while they work
+     * below them, only remove those nobody is using.
+     */
+    for(size_t i = dirs->count; i > 0; i--) {
+        dir = &dirs->files[i - 1];
+        if(i < dirs->count && strcmp(dir->name, dirs->files[i].name) == 0)
+            continue;
+        if(strchr(dir->name, '/') != NULL)
+            continue;
+        if(path_lock_name(dir->name, lock_name))
+            continue;
+        fd = take_lock(install_dir, lock_name, 1, 0);
+        if(fd < 0)
+            continue;
+        if(uninstall_directory(dir, install_dir))
+            ret = 1;
+        close(fd);
+    }
 
 cleanup:
-    free(pkgfiles_dir);
+    unlock_paths(&locks);
+    free(lock_name);
     return ret;
 }
 
+/* the package is listed once and removed from each install directory */
 int
-install(char **package_dirs, int package_count, char *install_dir)
+uninstall_pkg(
+    char *pkg_dir,
+    char **install_dirs,
+    int install_count,
+    struct install_opts *opts)
 {
     int ret = 0;
+    struct listed_pkg pkg;
+    struct pkg_file_list dirs = {0};
+
+    if(load_listed_pkg(pkg_dir, &pkg))
+        return 1;
+    for(int i = 0; i < install_count; i++) {
+        if(uninstall_pkg_links(&pkg, install_dirs[i], &dirs, opts->wait))
+            ret = 1;
+        if(prune_dirs(&dirs, install_dirs[i], opts->wait))
+            ret = 1;
+        pkg_file_list_free(&dirs);
+    }
+    listed_pkg_free(&pkg);
+    return ret;
+}
+
+int
+install(
+    char **package_dirs,
+    int package_count,
+    char **install_dirs,
+    int install_count,
+    struct install_opts *opts)
+{
+    int ret = 0;
+    int installed_count = 0;
+    char **installed;
+
+    installed = malloc(package_count * sizeof(*installed));
+    if(installed == NULL) {
+        perror("malloc failed");
+        return 1;
+    }
     for(int i = 0; i < package_count; i++)
-        if(install_pkg(package_dirs[i], install_dir)) {
+        if(install_pkg(package_dirs[i], install_dirs, install_count, opts)) {
             fprintf(stderr,
                 "failed to install package '%s'\n", package_dirs[i]);
             ret = 1;
-            if(uninstall_pkg(package_dirs[i], install_dir))
+            if(uninstall_pkg(package_dirs[i], install_dirs, install_count,
+                    opts))
                 fprintf(stderr, "failed to uninstall package '%s'\n",
                     package_dirs[i]);
+        } else {
+            installed[installed_count++] = package_dirs[i];
         }
+    for(int j = 0; j < install_count; j++)
+        if(update_installed(install_dirs[j], installed, installed_count,
+                NULL, 0, opts->wait))
+            ret = 1;
+    free(installed);
     return ret;
 }
 
+/*
+ * remove every listed package from one install directory. directories are
+ * pruned once, after all packages.
+ */
 int
-uninstall(char **package_dirs, int package_count, char *install_dir)
+uninstall_target(struct uninstall_ctx *ctx, char *install_dir)
 {
     int ret = 0;
-    for(int i = 0; i < package_count; i++)
-        if(uninstall_pkg(package_dirs[i], install_dir)) {
-            fprintf(stderr,
-                "failed to uninstall package '%s'\n", package_dirs[i]);
+    int removed_count = 0;
+    char **removed;
+    struct pkg_file_list dirs = {0};
+
+    removed = malloc(ctx->pkg_count * sizeof(*removed));
+    if(removed == NULL) {
+        perror("malloc failed");
+        return 1;
+    }
+    for(int i = 0; i < ctx->pkg_count; i++) {
+        if(ctx->pkgs[i].real_pkgfiles_dir == NULL)
+            continue;
+        if(uninstall_pkg_links(&ctx->pkgs[i], install_dir, &dirs,
+                ctx->opts->wait)) {
+            fprintf(stderr, "failed to uninstall package '%s'\n",
+                ctx->pkgs[i].pkg_dir);
             ret = 1;
+        } else {
+            removed[removed_count++] = ctx->pkgs[i].pkg_dir;
         }
+    }
+    if(prune_dirs(&dirs, install_dir, ctx->opts->wait))
+        ret = 1;
+    if(update_installed(install_dir, NULL, 0, removed, removed_count,
+            ctx->opts->wait))
+        ret = 1;
+    pkg_file_list_free(&dirs);
+    free(removed);
     return ret;
 }
 
+void *
+uninstall_worker(void *ctx)
+{
+    struct uninstall_ctx *uctx = ctx;
+    int i;
+
+    for(;;) {
+        pthread_mutex_lock(&uctx->lock);
+        i = uctx->next++;
+        pthread_mutex_unlock(&uctx->lock);
+        if(i >= uctx->install_count)
+            break;
+        if(uninstall_target(uctx, uctx->install_dirs[i])) {
+            pthread_mutex_lock(&uctx->lock);
+            uctx->failed = 1;
+            pthread_mutex_unlock(&uctx->lock);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * each package is listed once, then the install directories are shared out
+ * between up to jobs threads, which remove every package from theirs.
+ */
 int
-main(int argc, char **argv)
+uninstall(
+    char **package_dirs,
+    int package_count,
+    char **install_dirs,
+    int install_count,
+    struct install_opts *opts)
 {
     int ret = 0;
-    char *install_dir, *default_package_dir;
-    char **package_dirs;
-    int package_count;
-
-    default_package_dir = DEFAULT_PACKAGE_DIR;
+    int jobs, started;
+    pthread_t *threads;
+    struct uninstall_ctx ctx;
 
-    if(argc < 2) {
-        fprintf(stderr, "too few arguments\n");
-        ret = 1;
-        goto done;
-    } else if (argc == 2) {
-        package_dirs = &default_package_dir;
-        package_count = 1;
-        install_dir = DEFAULT_INSTALL_DIR;
-    } else if(argc == 3) {
-        package_dirs = &argv[2];
-        package_count = 1;
-        install_dir = DEFAULT_INSTALL_DIR;
-    } else {
-        package_dirs = &argv[2];
-        package_count = argc - 3;
-        install_dir = argv[argc - 1];
+    threads = NULL;
+    ctx.pkgs = calloc(package_count, sizeof(*ctx.pkgs));
+    if(ctx.pkgs == NULL) {
+        perror("calloc failed");
+        return 1;
     }
+    ctx.pkg_count = package_count;
+    ctx.install_dirs = install_dirs;
+    ctx.install_count = install_count;
+    ctx.opts = opts;
+    ctx.next = 0;
+    ctx.failed = 0;
+    pthread_mutex_init(&ctx.lock, NULL);
 
-    if(strcmp(argv[1], "install") == 0) {
-        if(install(package_dirs, package_count, install_dir))
+    for(int i = 0; i < package_count; i++)
+        if(load_listed_pkg(package_dirs[i], &ctx.pkgs[i])) {
+            fprintf(stderr,
+                "failed to uninstall package '%s'\n", package_dirs[i]);
             ret = 1;
-    } else if(strcmp(argv[1], "uninstall") == 0) {
-        if(uninstall(package_dirs, package_count, install_dir))
+        }
+
+    jobs = opts->jobs;
+    if(jobs > install_count)
+        jobs = install_count;
+    if(jobs > 1) {
+        threads = malloc(jobs * sizeof(*threads));
+        if(threads == NULL) {
+            perror("malloc failed");
             ret = 1;
-    } else {
-        fprintf(stderr, "unrecognised subcommand '%s'\n", argv[1]);
+            goto cleanup;
+        }
+    }
+    for(started = 0; started < jobs && jobs > 1; started++)
+        if(pthread_create(&threads[started], NULL, uninstall_worker, &ctx)) {
+            fprintf(stderr, "failed to create uninstall thread\n");
+            break;
+        }
+    if(started == 0)
+        uninstall_worker(&ctx);
+    for(int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    if(ctx.failed)
         ret = 1;
+
+cleanup:
+    for(int i = 0; i < package_count; i++)
+        listed_pkg_free(&ctx.pkgs[i]);
+    free(ctx.pkgs);
+    pthread_mutex_destroy(&ctx.lock);
+    free(threads);
+    return ret;
+}
+
+static const uint32_t BLAKE3_IV[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+    0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+/* message word order of each round, the permutation applied repeatedly */
+static const uint8_t BLAKE3_MSG_SCHEDULE[7][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+    {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+    {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+    {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+    {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+    {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13},
+};
+
+#define BLAKE3_CHUNK_START (1 << 0)
+#define BLAKE3_CHUNK_END (1 << 1)
+#define BLAKE3_PARENT (1 << 2)
+#define BLAKE3_ROOT (1 << 3)
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static inline void
+blake3_g(uint32_t *state, int a, int b, int c, int d, uint32_t mx, uint32_t my)
+{
+    state[a] = state[a] + state[b] + mx;
+    state[d] = ROTR32(state[d] ^ state[a], 16);
+    state[c] = state[c] + state[d];
+    state[b] = ROTR32(state[b] ^ state[c], 12);
+    state[a] = state[a] + state[b] + my;
+    state[d] = ROTR32(state[d] ^ state[a], 8);
+    state[c] = state[c] + state[d];
+    state[b] = ROTR32(state[b] ^ state[c], 7);
+}
+
+/*
+ * a plain scalar compression function, one block at a time. there is no
+ * simd code, throughput comes from hashing files and subtrees on several
+ * threads.
+ */
+void
+blake3_compress(
+    const uint32_t cv[8],
+    const uint32_t block_words[16],
+    uint64_t counter,
+    uint32_t block_len,
+    uint32_t flags,
+    uint32_t out[16])
+{
+    uint32_t state[16];
+    const uint32_t *m = block_words;
+    const uint8_t *s;
+    int round, i;
+
+    for(i = 0; i < 8; i++)
+        state[i] = cv[i];
+    for(i = 0; i < 4; i++)
+        state[i + 8] = BLAKE3_IV[i];
+    state[12] = (uint32_t)counter;
+    state[13] = (uint32_t)(counter >> 32);
+    state[14] = block_len;
+    state[15] = flags;
+
+    for(round = 0; round < 7; round++) {
+        s = BLAKE3_MSG_SCHEDULE[round];
+        blake3_g(state, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+        blake3_g(state, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+        blake3_g(state, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+        blake3_g(state, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+        blake3_g(state, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+        blake3_g(state, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+        blake3_g(state, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+        blake3_g(state, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+    }
+
+    for(i = 0; i < 8; i++) {
+        out[i] = state[i] ^ state[i + 8];
+        out[i + 8] = state[i + 8] ^ cv[i];
+    }
+}
+
+void
+blake3_words_from_block(const uint8_t *block, uint32_t *words)
+{
+    for(int i = 0; i < 16; i++)
+        words[i] = (uint32_t)block[4 * i]
+            | (uint32_t)block[4 * i + 1] << 8
+            | (uint32_t)block[4 * i + 2] << 16
+            | (uint32_t)block[4 * i + 3] << 24;
+}
+
+void
+blake3_chunk_state_init(struct blake3_chunk_state *self, uint64_t counter)
+{
+    memcpy(self->cv, BLAKE3_IV, sizeof(self->cv));
+    self->chunk_counter = counter;
+    memset(self->block, 0, sizeof(self->block));
+    self->block_len = 0;
+    self->blocks_compressed = 0;
+}
+
+size_t
+blake3_chunk_state_len(const struct blake3_chunk_state *self)
+{
+    return BLAKE3_BLOCK_LEN * (size_t)self->blocks_compressed
+        + self->block_len;
+}
+
+uint32_t
+blake3_chunk_state_start_flag(const struct blake3_chunk_state *self)
+{
+    return self->blocks_compressed == 0 ? BLAKE3_CHUNK_START : 0;
+}
+
+void
+blake3_chunk_state_update(
+    struct blake3_chunk_state *self, const uint8_t *input, size_t input_len)
+{
+    uint32_t words[16], out[16];
+    size_t take;
+
+    while(input_len > 0) {
+        if(self->block_len == BLAKE3_BLOCK_LEN) {
+            blake3_words_from_block(self->block, words);
+            blake3_compress(self->cv, words, self->chunk_counter,
+                BLAKE3_BLOCK_LEN, blake3_chunk_state_start_flag(self), out);
+            memcpy(self->cv, out, sizeof(self->cv));
+            self->blocks_compressed++;
+            memset(self->block, 0, sizeof(self->block));
+            self->block_len = 0;
+        }
+        take = BLAKE3_BLOCK_LEN - self->block_len;
+        if(take > input_len)
+            take = input_len;
+        memcpy(&self->block[self->block_len], input, take);
+        self->block_len += take;
+        input += take;
+        input_len -= take;
+    }
+}
+
+void
+blake3_parent_cv(
+    const uint32_t left[8], const uint32_t right[8], uint32_t out_cv[8])
+{
+    uint32_t words[16], out[16];
+
+    memcpy(words, left, 8 * sizeof(uint32_t));
+    memcpy(&words[8], right, 8 * sizeof(uint32_t));
+    blake3_compress(BLAKE3_IV, words, 0, BLAKE3_BLOCK_LEN, BLAKE3_PARENT, out);
+    memcpy(out_cv, out, 8 * sizeof(uint32_t));
+}
+
+void
+blake3_hasher_init(struct blake3_hasher *self)
+{
+    blake3_hasher_init_at(self, 0);
+}
+
+/* start hashing a subtree whose first chunk is chunk_counter of the input */
+void
+blake3_hasher_init_at(struct blake3_hasher *self, uint64_t chunk_counter)
+{
+    blake3_chunk_state_init(&self->chunk, chunk_counter);
+    self->cv_stack_len = 0;
+}
+
+void
+blake3_hasher_update(
+    struct blake3_hasher *self, const void *input, size_t input_len)
+{
+    const uint8_t *bytes = input;
+    uint32_t words[16], out[16], cv[8];
+    uint64_t total_chunks;
+    size_t take;
+
+    while(input_len > 0) {
+        /* a full chunk is only finished once more input arrives, the last
+         * chunk must be left for finalize to mark as root */
+        if(blake3_chunk_state_len(&self->chunk) == BLAKE3_CHUNK_LEN) {
+            blake3_words_from_block(self->chunk.block, words);
+            blake3_compress(self->chunk.cv, words, self->chunk.chunk_counter,
+                self->chunk.block_len,
+                blake3_chunk_state_start_flag(&self->chunk) | BLAKE3_CHUNK_END,
+                out);
+            memcpy(cv, out, sizeof(cv));
+            total_chunks = self->chunk.chunk_counter + 1;
+            /* merge completed subtrees, one per trailing zero bit */
+            while((total_chunks & 1) == 0) {
+                self->cv_stack_len--;
+                blake3_parent_cv(self->cv_stack[self->cv_stack_len], cv, cv);
+                total_chunks >>= 1;
+            }
+            memcpy(self->cv_stack[self->cv_stack_len++], cv, sizeof(cv));
+            blake3_chunk_state_init(&self->chunk, self->chunk.chunk_counter + 1);
+        }
+        take = BLAKE3_CHUNK_LEN - blake3_chunk_state_len(&self->chunk);
+        if(take > input_len)
+            take = input_len;
+        blake3_chunk_state_update(&self->chunk, bytes, take);
+        bytes += take;
+        input_len -= take;
+    }
+}
+
+/*
+ * compress the output node of what was hashed so far. flags is BLAKE3_ROOT
+ * for the hash of a whole input or 0 for the chaining value of a subtree.
+ */
+void
+blake3_hasher_output(
+    const struct blake3_hasher *self, uint32_t root_flag, uint32_t state[16])
+{
+    uint32_t input_cv[8], words[16];
+    uint64_t counter;
+    uint32_t block_len, flags;
+    int remaining;
+
+    /* output node of the last chunk */
+    memcpy(input_cv, self->chunk.cv, sizeof(input_cv));
+    blake3_words_from_block(self->chunk.block, words);
+    counter = self->chunk.chunk_counter;
+    block_len = self->chunk.block_len;
+    flags = blake3_chunk_state_start_flag(&self->chunk) | BLAKE3_CHUNK_END;
+
+    remaining = self->cv_stack_len;
+    while(remaining > 0) {
+        remaining--;
+        blake3_compress(input_cv, words, counter, block_len, flags, state);
+        memcpy(words, self->cv_stack[remaining], 8 * sizeof(uint32_t));
+        memcpy(&words[8], state, 8 * sizeof(uint32_t));
+        memcpy(input_cv, BLAKE3_IV, sizeof(input_cv));
+        counter = 0;
+        block_len = BLAKE3_BLOCK_LEN;
+        flags = BLAKE3_PARENT;
+    }
+
+    /* a root chunk keeps its counter, a root parent is always 0 */
+    blake3_compress(input_cv, words, flags & BLAKE3_PARENT ? 0 : counter,
+        block_len, flags | root_flag, state);
+}
+
+void
+blake3_hasher_finalize(const struct blake3_hasher *self, uint8_t *out)
+{
+    uint32_t state[16];
+
+    blake3_hasher_output(self, BLAKE3_ROOT, state);
+    blake3_state_bytes(state, out);
+}
+
+void
+blake3_hasher_subtree_cv(const struct blake3_hasher *self, uint32_t cv[8])
+{
+    uint32_t state[16];
+
+    blake3_hasher_output(self, 0, state);
+    memcpy(cv, state, 8 * sizeof(uint32_t));
+}
+
+void
+blake3_state_bytes(const uint32_t state[16], uint8_t *out)
+{
+    for(int i = 0; i < BLAKE3_OUT_LEN / 4; i++) {
+        out[4 * i] = state[i];
+        out[4 * i + 1] = state[i] >> 8;
+        out[4 * i + 2] = state[i] >> 16;
+        out[4 * i + 3] = state[i] >> 24;
+    }
+}
+
+/*
+ * hash of an input from the chaining values of its consecutive subtrees of
+ * HASH_SUBTREE_SIZE bytes, count > 1. subtrees are merged the way
+ * blake3_hasher_update merges chunks, the last one only at the root.
+ */
+void
+blake3_merge_subtrees(uint32_t (*cvs)[8], size_t count, uint8_t *out)
+{
+    uint32_t stack[BLAKE3_MAX_DEPTH][8], cv[8], words[16], state[16];
+    size_t stack_len, total;
+
+    stack_len = 0;
+    for(size_t i = 0; i + 1 < count; i++) {
+        memcpy(cv, cvs[i], sizeof(cv));
+        for(total = i + 1; (total & 1) == 0; total >>= 1) {
+            stack_len--;
+            blake3_parent_cv(stack[stack_len], cv, cv);
+        }
+        memcpy(stack[stack_len++], cv, sizeof(cv));
+    }
+
+    memcpy(cv, cvs[count - 1], sizeof(cv));
+    while(stack_len > 1) {
+        stack_len--;
+        blake3_parent_cv(stack[stack_len], cv, cv);
+    }
+    memcpy(words, stack[0], 8 * sizeof(uint32_t));
+    memcpy(&words[8], cv, 8 * sizeof(uint32_t));
+    blake3_compress(BLAKE3_IV, words, 0, BLAKE3_BLOCK_LEN,
+        BLAKE3_PARENT | BLAKE3_ROOT, state);
+    blake3_state_bytes(state, out);
+}
+
+/* append a copy of name and link, link may be NULL */
+int
+pkg_file_list_push(
+    struct pkg_file_list *list,
+    char *name,
+    size_t name_len,
+    unsigned int type,
+    char *link,
+    size_t link_len)
+{
+    struct pkg_file *files, *file;
+
+    if(list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        files = realloc(list->files, list->capacity * sizeof(*files));
+        if(files == NULL) {
+            perror("realloc failed");
+            return 1;
+        }
+        list->files = files;
+    }
+    file = &list->files[list->count];
+    file->type = type;
+    file->target_link = NULL;
+    file->name = strndup(name, name_len);
+    file->link = link == NULL ? NULL : strndup(link, link_len);
+    if(file->name == NULL || (link != NULL && file->link == NULL)) {
+        perror("strndup failed");
+        free(file->name);
+        free(file->link);
+        return 1;
+    }
+    list->count++;
+    return 0;
+}
+
+int
+pkg_file_list_add(char *src_file, unsigned int type, void *ctx)
+{
+    int ret = 0;
+    int link_len;
+    struct { char *src; struct pkg_file_list *list; } *cast_ctx;
+    char *file_name, *link;
+
+    cast_ctx = ctx;
+    link = NULL;
+    link_len = 0;
+
+    file_name = remove_prefix(cast_ctx->src, src_file);
+    if(file_name == NULL) {
+        fprintf(stderr, "src_file does not begin with src_dir\n");
+        ret = 1;
+        goto cleanup;
+    }
+    while(*file_name == '/') file_name++;
+
+    if(type == DT_LNK) {
+        link = malloc(PATH_MAX);
+        if(link == NULL) {
+            perror("malloc failed");
+            ret = 1;
+            goto cleanup;
+        }
+        link_len = readlink(src_file, link, PATH_MAX - 1);
+        if(link_len < 0) {
+            char *err = strerror(errno);
+            fprintf(stderr, "failed to read link of '%s': %s\n", src_file, err);
+            ret = 1;
+            goto cleanup;
+        }
+    }
+
+    if(pkg_file_list_push(cast_ctx->list, file_name, strlen(file_name), type,
+            link, link_len)) {
+        ret = 1;
+        goto cleanup;
+    }
+
+cleanup:
+    free(link);
+    return ret;
+}
+
+int
+pkg_file_cmp(const void *a, const void *b)
+{
+    return strcmp(((struct pkg_file *)a)->name, ((struct pkg_file *)b)->name);
+}
+
+void
+pkg_file_list_free(struct pkg_file_list *list)
+{
+    for(size_t i = 0; i < list->count; i++) {
+        free(list->files[i].name);
+        free(list->files[i].link);
+        free(list->files[i].target_link);
+    }
+    free(list->files);
+    list->files = NULL;
+    list->count = list->capacity = 0;
+}
+
+/* list every file under pkgfiles_dir sorted by name */
+int
+list_pkg_files(char *pkgfiles_dir, struct pkg_file_list *list)
+{
+    struct { char *src; struct pkg_file_list *list; } ctx;
+    ctx.src = pkgfiles_dir;
+    ctx.list = list;
+    if(find_recursive(pkgfiles_dir, pkg_file_list_add, &ctx)) {
+        fprintf(stderr, "failed to list files in '%s'\n", pkgfiles_dir);
+        return 1;
+    }
+    qsort(list->files, list->count, sizeof(*list->files), pkg_file_cmp);
+    return 0;
+}
+
+/*
+ * regular files are hashed by content and symbolic links by the link text.
+ */
+int
+hash_file(char *file_name, unsigned int type, uint8_t *out)
+{
+    int ret = 0;
+    int fd;
+    ssize_t len;
+    char *buf;
+    struct blake3_hasher hasher;
+
+    if(type != DT_LNK) {
+        fd = open(file_name, O_RDONLY);
+        if(fd < 0) {
+            char *err = strerror(errno);
+            fprintf(stderr, "failed to open '%s': %s\n", file_name, err);
+            return 1;
+        }
+        ret = hash_fd(fd, file_name, out);
+        close(fd);
+        return ret;
+    }
+
+    buf = malloc(HASH_READ_SIZE);
+    if(buf == NULL) {
+        perror("malloc failed");
+        return 1;
+    }
+    len = readlink(file_name, buf, HASH_READ_SIZE);
+    if(len < 0) {
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to read link of '%s': %s\n", file_name, err);
+        ret = 1;
+        goto cleanup;
+    }
+    blake3_hasher_init(&hasher);
+    blake3_hasher_update(&hasher, buf, len);
+    blake3_hasher_finalize(&hasher, out);
+
+cleanup:
+    free(buf);
+    return ret;
+}
+
+/* hash the rest of the file open as fd on this thread */
+int
+hash_fd(int fd, char *file_name, uint8_t *out)
+{
+    int ret = 0;
+    ssize_t len;
+    char *buf;
+    struct blake3_hasher hasher;
+
+    buf = malloc(HASH_READ_SIZE);
+    if(buf == NULL) {
+        perror("malloc failed");
+        return 1;
+    }
+
+    blake3_hasher_init(&hasher);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    while((len = read(fd, buf, HASH_READ_SIZE)) != 0) {
+        if(len < 0) {
+            if(errno == EINTR)
+                continue;
+            char *err = strerror(errno);
+            fprintf(stderr, "failed to read '%s': %s\n", file_name, err);
+            ret = 1;
+            goto cleanup;
+        }
+        blake3_hasher_update(&hasher, buf, len);
+    }
+    blake3_hasher_finalize(&hasher, out);
+
+cleanup:
+    free(buf);
+    return ret;
+}
+
+/*
+ * share a file of more than HASH_SUBTREE_SIZE bytes out between the hashing
+ * threads a subtree at a time. on success the split owns fd.
+ */
+int
+digest_split_start(
+    struct digest_ctx *ctx, int fd, off_t size, char *file_name, uint8_t *out)
+{
+    struct digest_split *split;
+
+    split = calloc(1, sizeof(*split));
+    if(split == NULL) {
+        perror("calloc failed");
+        return 1;
+    }
+    split->count = (size + HASH_SUBTREE_SIZE - 1) / HASH_SUBTREE_SIZE;
+    split->file_name = strdup(file_name);
+    split->cvs = calloc(split->count, sizeof(*split->cvs));
+    if(split->file_name == NULL || split->cvs == NULL) {
+        perror("calloc failed");
+        free(split->file_name);
+        free(split->cvs);
+        free(split);
+        return 1;
+    }
+    split->out = out;
+    split->fd = fd;
+    split->size = size;
+
+    pthread_mutex_lock(&ctx->lock);
+    split->next_split = ctx->splits;
+    ctx->splits = split;
+    pthread_mutex_unlock(&ctx->lock);
+    return 0;
+}
+
+/*
+ * hash one subtree of a split file, read with pread so threads share the fd.
+ * the thread that finishes the last subtree merges them and frees the split.
+ */
+void
+digest_split_piece(
+    struct digest_ctx *ctx, struct digest_split *split, size_t piece)
+{
+    int failed = 0;
+    int last;
+    ssize_t len;
+    off_t offset, end;
+    char *buf;
+    struct blake3_hasher hasher;
+
+    buf = malloc(HASH_READ_SIZE);
+    if(buf == NULL) {
+        perror("malloc failed");
+        failed = 1;
+        goto done;
+    }
+
+    offset = (off_t)piece * HASH_SUBTREE_SIZE;
+    end = offset + HASH_SUBTREE_SIZE;
+    if(end > split->size)
+        end = split->size;
+    blake3_hasher_init_at(&hasher,
+        (uint64_t)piece * (HASH_SUBTREE_SIZE / BLAKE3_CHUNK_LEN));
+    while(offset < end) {
+        len = pread(split->fd, buf,
+            end - offset < HASH_READ_SIZE ? end - offset : HASH_READ_SIZE,
+            offset);
+        if(len < 0 && errno == EINTR)
+            continue;
+        if(len < 0) {
+            char *err = strerror(errno);
+            fprintf(stderr, "failed to read '%s': %s\n", split->file_name,
+                err);
+            failed = 1;
+            goto done;
+        }
+        if(len == 0) {
+            fprintf(stderr, "'%s' was truncated while hashing\n",
+                split->file_name);
+            failed = 1;
+            goto done;
+        }
+        blake3_hasher_update(&hasher, buf, len);
+        offset += len;
+    }
+    blake3_hasher_subtree_cv(&hasher, split->cvs[piece]);
+
+done:
+    free(buf);
+    pthread_mutex_lock(&ctx->lock);
+    if(failed)
+        split->failed = 1;
+    last = ++split->done == split->count;
+    if(last && split->failed)
+        ctx->failed = 1;
+    pthread_mutex_unlock(&ctx->lock);
+    if(!last)
+        return;
+
+    if(!split->failed)
+        blake3_merge_subtrees(split->cvs, split->count, split->out);
+    close(split->fd);
+    free(split->file_name);
+    free(split->cvs);
+    free(split);
+}
+
+/*
+ * hash file i of the list, or start sharing it out if it is large. called
+ * with ctx->opening raised for regular files, which is dropped once the size
+ * is known so idle workers stop waiting for a split.
+ */
+int
+digest_file(struct digest_ctx *ctx, size_t i, char *file_name)
+{
+    int ret = 0;
+    int fd = -1;
+    struct pkg_file *file;
+    struct stat st;
+
+    file = &ctx->list->files[i];
+    if(snprintf(file_name, PATH_MAX, "%s/%s", ctx->pkgfiles_dir,
+            file->name) >= PATH_MAX) {
+        fprintf(stderr, "path exceeds PATH_MAX '%s'\n", file->name);
+        ret = 1;
+        goto opened;
+    }
+    if(file->type == DT_LNK) {
+        ret = hash_file(file_name, file->type, ctx->digests[i]);
+        goto opened;
+    }
+
+    fd = open(file_name, O_RDONLY);
+    if(fd < 0 || fstat(fd, &st)) {
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to open '%s': %s\n", file_name, err);
+        ret = 1;
+        goto opened;
+    }
+    if(st.st_size > HASH_SUBTREE_SIZE) {
+        if(digest_split_start(ctx, fd, st.st_size, file_name,
+                ctx->digests[i]))
+            ret = 1;
+        else
+            fd = -1;
+        goto opened;
+    }
+
+opened:
+    if(file->type == DT_REG) {
+        pthread_mutex_lock(&ctx->lock);
+        ctx->opening--;
+        pthread_cond_broadcast(&ctx->cond);
+        pthread_mutex_unlock(&ctx->lock);
+    }
+    if(ret == 0 && fd >= 0)
+        ret = hash_fd(fd, file_name, ctx->digests[i]);
+    if(fd >= 0)
+        close(fd);
+    return ret;
+}
+
+/*
+ * subtrees of large files are handed out before new files so a file that is
+ * started is finished soon. a worker with nothing to do waits while another
+ * is still opening a file, as that file may turn out to be large.
+ */
+void *
+digest_worker(void *ctx)
+{
+    struct digest_ctx *dctx = ctx;
+    struct digest_split *split;
+    char *file_name;
+    size_t i, piece;
+
+    file_name = malloc(PATH_MAX);
+    if(file_name == NULL) {
+        perror("malloc failed");
+        pthread_mutex_lock(&dctx->lock);
+        dctx->failed = 1;
+        pthread_mutex_unlock(&dctx->lock);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&dctx->lock);
+    for(;;) {
+        while(dctx->splits == NULL && dctx->next >= dctx->list->count
+            && dctx->opening > 0)
+            pthread_cond_wait(&dctx->cond, &dctx->lock);
+        if(dctx->splits != NULL) {
+            split = dctx->splits;
+            piece = split->next++;
+            if(split->next == split->count)
+                dctx->splits = split->next_split;
+            pthread_mutex_unlock(&dctx->lock);
+            digest_split_piece(dctx, split, piece);
+            pthread_mutex_lock(&dctx->lock);
+            continue;
+        }
+        if(dctx->next >= dctx->list->count)
+            break;
+        i = dctx->next++;
+        if(dctx->list->files[i].type != DT_REG
+            && dctx->list->files[i].type != DT_LNK)
+            continue;
+        if(dctx->list->files[i].type == DT_REG)
+            dctx->opening++;
+        pthread_mutex_unlock(&dctx->lock);
+        if(digest_file(dctx, i, file_name)) {
+            pthread_mutex_lock(&dctx->lock);
+            dctx->failed = 1;
+        } else {
+            pthread_mutex_lock(&dctx->lock);
+        }
+    }
+    pthread_mutex_unlock(&dctx->lock);
+
+    free(file_name);
+    return NULL;
+}
+
+/*
+ * hash every file of a package. files are shared out between one thread per
+ * online cpu, large ones a subtree at a time, so package sets are bound by
+ * the disk rather than the hash even when most of the data is in one file.
+ */
+int
+digest_pkg_files(
+    char *pkg_dir,
+    struct pkg_file_list *list,
+    uint8_t (**digests)[BLAKE3_OUT_LEN])
+{
+    int ret = 0;
+    long thread_count, started;
+    pthread_t *threads;
+    struct digest_ctx ctx;
+
+    *digests = NULL;
+    threads = NULL;
+    ctx.pkgfiles_dir = malloc(PATH_MAX);
+    if(ctx.pkgfiles_dir == NULL) {
+        perror("malloc failed");
+        return 1;
+    }
+    pthread_mutex_init(&ctx.lock, NULL);
+    pthread_cond_init(&ctx.cond, NULL);
+
+    if(snprintf(ctx.pkgfiles_dir, PATH_MAX, "%s/%s", pkg_dir,
+            PACKAGE_FILES_DIRNAME) >= PATH_MAX) {
+        fprintf(stderr,
+            "'%s' in '%s' exceeds PATH_MAX\n", PACKAGE_FILES_DIRNAME, pkg_dir);
+        ret = 1;
+        goto cleanup;
+    }
+    if(list_pkg_files(ctx.pkgfiles_dir, list)) {
+        ret = 1;
+        goto cleanup;
+    }
+
+    *digests = calloc(list->count ? list->count : 1, BLAKE3_OUT_LEN);
+    if(*digests == NULL) {
+        perror("calloc failed");
+        ret = 1;
+        goto cleanup;
+    }
+    ctx.list = list;
+    ctx.digests = *digests;
+    ctx.next = 0;
+    ctx.splits = NULL;
+    ctx.opening = 0;
+    ctx.failed = 0;
+
+    thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if(thread_count < 1)
+        thread_count = 1;
+    threads = malloc(thread_count * sizeof(*threads));
+    if(threads == NULL) {
+        perror("malloc failed");
+        ret = 1;
+        goto cleanup;
+    }
+    for(started = 0; started < thread_count; started++)
+        if(pthread_create(&threads[started], NULL, digest_worker, &ctx)) {
+            fprintf(stderr, "failed to create hashing thread\n");
+            break;
+        }
+    /* if no thread could be started hash on this one */
+    if(started == 0)
+        digest_worker(&ctx);
+    for(long i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    if(ctx.failed) {
+        fprintf(stderr, "failed to hash files in '%s'\n", ctx.pkgfiles_dir);
+        ret = 1;
+        goto cleanup;
+    }
+
+cleanup:
+    pthread_cond_destroy(&ctx.cond);
+    pthread_mutex_destroy(&ctx.lock);
+    free(ctx.pkgfiles_dir);
+    free(threads);
+    return ret;
+}
+
+void
+format_digest(uint8_t *digest, char *buf)
+{
+    for(int i = 0; i < BLAKE3_OUT_LEN; i++)
+        sprintf(&buf[2 * i], "%02x", digest[i]);
+}
+
+char
+digest_type_char(unsigned int type)
+{
+    return type == DT_LNK ? 'l' : 'f';
+}
+
+/*
+ * build the digest listing of a package, one line per regular file or link:
+ *   {f/l} <digest> <name>
+ * lines are sorted by name so the package digest, the hash of the listing, is
+ * independent of directory order.
+ */
+int
+build_pkg_digest(
+    char *pkg_dir, char **body, size_t *body_len, uint8_t *pkg_digest)
+{
+    int ret = 0;
+    size_t len, capacity;
+    char hex[2 * BLAKE3_OUT_LEN + 1], *buf, *new_buf;
+    struct pkg_file_list list = {0};
+    uint8_t (*digests)[BLAKE3_OUT_LEN];
+    struct blake3_hasher hasher;
+
+    buf = NULL;
+    if(digest_pkg_files(pkg_dir, &list, &digests)) {
+        ret = 1;
+        goto cleanup;
+    }
+
+    len = capacity = 0;
+    for(size_t i = 0; i < list.count; i++) {
+        if(list.files[i].type != DT_REG && list.files[i].type != DT_LNK)
+            continue;
+        if(len + PATH_MAX + sizeof(hex) + 4 > capacity) {
+            capacity = capacity * 2 + PATH_MAX + sizeof(hex) + 4;
+            new_buf = realloc(buf, capacity);
+            if(new_buf == NULL) {
+                perror("realloc failed");
+                ret = 1;
+                goto cleanup;
+            }
+            buf = new_buf;
+        }
+        format_digest(digests[i], hex);
+        len += snprintf(&buf[len], capacity - len, "%c %s %s\n",
+            digest_type_char(list.files[i].type), hex, list.files[i].name);
+    }
+
+    blake3_hasher_init(&hasher);
+    blake3_hasher_update(&hasher, buf, len);
+    blake3_hasher_finalize(&hasher, pkg_digest);
+    *body = buf;
+    *body_len = len;
+    buf = NULL;
+
+cleanup:
+    free(buf);
+    free(digests);
+    pkg_file_list_free(&list);
+    return ret;
+}
+
+/*
+ * write PACKAGE_DIGEST_FNAME next to pkginfo. the first line holds the
+ * package digest so a change check only has to compare one line.
+ */
+int
+write_pkg_digest(char *pkg_dir)
+{
+    int ret = 0;
+    size_t body_len;
+    char *body, *digest_file, *tmp_file;
+    char hex[2 * BLAKE3_OUT_LEN + 1];
+    uint8_t pkg_digest[BLAKE3_OUT_LEN];
+    FILE *f;
+
+    printf("digesting '%s'\n", pkg_dir);
+
+    body = NULL;
+    f = NULL;
+    digest_file = malloc(PATH_MAX);
+    tmp_file = malloc(PATH_MAX);
+    if(digest_file == NULL || tmp_file == NULL) {
+        perror("malloc failed");
+        ret = 1;
+        goto cleanup;
+    }
+    if(snprintf(digest_file, PATH_MAX, "%s/%s", pkg_dir, PACKAGE_DIGEST_FNAME)
+            >= PATH_MAX
+        || snprintf(tmp_file, PATH_MAX, "%s.tmp", digest_file) >= PATH_MAX) {
+        fprintf(stderr,
+            "'%s' in '%s' exceeds PATH_MAX\n", PACKAGE_DIGEST_FNAME, pkg_dir);
+        ret = 1;
+        goto cleanup;
+    }
+
+    if(build_pkg_digest(pkg_dir, &body, &body_len, pkg_digest)) {
+        ret = 1;
+        goto cleanup;
+    }
+    format_digest(pkg_digest, hex);
+
+    f = fopen(tmp_file, "w");
+    if(f == NULL) {
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to open '%s': %s\n", tmp_file, err);
+        ret = 1;
+        goto cleanup;
+    }
+    if(fprintf(f, "pkg %s\n", hex) < 0
+        || fwrite(body, 1, body_len, f) != body_len) {
+        fprintf(stderr, "failed to write '%s'\n", tmp_file);
+        ret = 1;
+        goto cleanup;
+    }
+    if(fclose(f)) {
+        f = NULL;
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to write '%s': %s\n", tmp_file, err);
+        ret = 1;
+        goto cleanup;
+    }
+    f = NULL;
+    if(rename(tmp_file, digest_file)) {
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to rename '%s': %s\n", tmp_file, err);
+        ret = 1;
+        goto cleanup;
+    }
+    printf("%s\n", hex);
+
+cleanup:
+    if(f != NULL) {
+        fclose(f);
+        remove(tmp_file);
+    }
+    free(body);
+    free(digest_file);
+    free(tmp_file);
+    return ret;
+}
+
+/*
+ * compare the package against its stored digest. returns 0 if unchanged,
+ * otherwise every added, removed or modified file is reported.
+ */
+int
+verify_pkg_digest(char *pkg_dir)
+{
+    int ret = 0;
+    long stored_size;
+    size_t body_len, stored_len;
+    char *body, *stored, *digest_file, *a, *b, *a_end, *b_end;
+    char hex[2 * BLAKE3_OUT_LEN + 1];
+    uint8_t pkg_digest[BLAKE3_OUT_LEN];
+    FILE *f;
+
+    printf("verifying '%s'\n", pkg_dir);
+
+    body = stored = NULL;
+    f = NULL;
+    digest_file = malloc(PATH_MAX);
+    if(digest_file == NULL) {
+        perror("malloc failed");
+        ret = 1;
+        goto cleanup;
+    }
+    if(snprintf(digest_file, PATH_MAX, "%s/%s", pkg_dir, PACKAGE_DIGEST_FNAME)
+            >= PATH_MAX) {
+        fprintf(stderr,
+            "'%s' in '%s' exceeds PATH_MAX\n", PACKAGE_DIGEST_FNAME, pkg_dir);
+        ret = 1;
+        goto cleanup;
+    }
+
+    f = fopen(digest_file, "r");
+    if(f == NULL) {
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to open '%s': %s\n", digest_file, err);
+        ret = 1;
+        goto cleanup;
+    }
+    if(fseek(f, 0, SEEK_END) || (stored_size = ftell(f)) < 0
+        || fseek(f, 0, SEEK_SET)) {
+        fprintf(stderr, "failed to read '%s'\n", digest_file);
+        ret = 1;
+        goto cleanup;
+    }
+    stored_len = stored_size;
+    stored = malloc(stored_len + 1);
+    if(stored == NULL) {
+        perror("malloc failed");
+        ret = 1;
+        goto cleanup;
+    }
+    if(fread(stored, 1, stored_len, f) != stored_len) {
+        fprintf(stderr, "failed to read '%s'\n", digest_file);
+        ret = 1;
+        goto cleanup;
+    }
+    stored[stored_len] = '\0';
+
+    if(build_pkg_digest(pkg_dir, &body, &body_len, pkg_digest)) {
+        ret = 1;
+        goto cleanup;
+    }
+    format_digest(pkg_digest, hex);
+
+    if(strncmp(stored, "pkg ", 4) != 0 || (a = strchr(stored, '\n')) == NULL) {
+        fprintf(stderr, "invalid digest file '%s'\n", digest_file);
+        ret = 1;
+        goto cleanup;
+    }
+    a++;
+    if(strncmp(&stored[4], hex, 2 * BLAKE3_OUT_LEN) == 0)
+        goto cleanup;
+    ret = 1;
+
+    /* both listings are sorted by name, so walk them together */
+    b = body;
+    a_end = stored + stored_len;
+    b_end = body + body_len;
+    while(a < a_end || b < b_end) {
+        char *a_name, *b_name, *a_next, *b_next;
+        size_t a_name_len, b_name_len;
+        int cmp;
+
+        a_name = b_name = a_next = b_next = NULL;
+        if(a < a_end) {
+            a_next = strchr(a, '\n');
+            if(a_next == NULL || a_next - a < DIGEST_NAME_OFFSET) {
+                fprintf(stderr, "invalid digest file '%s'\n", digest_file);
+                goto cleanup;
+            }
+            a_name = a + DIGEST_NAME_OFFSET;
+        }
+        if(b < b_end) {
+            b_next = memchr(b, '\n', b_end - b);
+            b_name = b + DIGEST_NAME_OFFSET;
+        }
+
+        if(a_name == NULL) {
+            cmp = 1;
+        } else if(b_name == NULL) {
+            cmp = -1;
+        } else {
+            a_name_len = a_next - a_name;
+            b_name_len = b_next - b_name;
+            cmp = memcmp(a_name, b_name,
+                a_name_len < b_name_len ? a_name_len : b_name_len);
+            if(cmp == 0)
+                cmp = (a_name_len > b_name_len) - (a_name_len < b_name_len);
+        }
+
+        if(cmp < 0) {
+            printf("removed '%.*s'\n", (int)(a_next - a_name), a_name);
+            a = a_next + 1;
+        } else if(cmp > 0) {
+            printf("added '%.*s'\n", (int)(b_next - b_name), b_name);
+            b = b_next + 1;
+        } else {
+            if(memcmp(a, b, DIGEST_NAME_OFFSET) != 0)
+                printf("modified '%.*s'\n", (int)(a_next - a_name), a_name);
+            a = a_next + 1;
+            b = b_next + 1;
+        }
+    }
+
+cleanup:
+    if(f != NULL)
+        fclose(f);
+    free(body);
+    free(stored);
+    free(digest_file);
+    return ret;
+}
+
+int
+digest(char **package_dirs, int package_count)
+{
+    int ret = 0;
+    for(int i = 0; i < package_count; i++)
+        if(write_pkg_digest(package_dirs[i])) {
+            fprintf(stderr,
+                "failed to digest package '%s'\n", package_dirs[i]);
+            ret = 1;
+        }
+    return ret;
+}
+
+int
+verify(char **package_dirs, int package_count)
+{
+    int ret = 0;
+    for(int i = 0; i < package_count; i++)
+        if(verify_pkg_digest(package_dirs[i])) {
+            fprintf(stderr,
+                "package '%s' does not match its digest\n", package_dirs[i]);
+            ret = 1;
+        }
+    return ret;
+}
+
+char
+index_type_char(unsigned int type)
+{
+    switch(type) {
+    case DT_DIR:
+        return 'd';
+    case DT_LNK:
+        return 'l';
+    case DT_REG:
+        return 'f';
+    case DT_BLK:
+        return 'b';
+    case DT_CHR:
+        return 'c';
+    case DT_FIFO:
+        return 'p';
+    case DT_SOCK:
+        return 's';
+    default:
+        return '?';
+    }
+}
+
+unsigned int
+index_char_type(char c)
+{
+    switch(c) {
+    case 'd':
+        return DT_DIR;
+    case 'l':
+        return DT_LNK;
+    case 'f':
+        return DT_REG;
+    case 'b':
+        return DT_BLK;
+    case 'c':
+        return DT_CHR;
+    case 'p':
+        return DT_FIFO;
+    case 's':
+        return DT_SOCK;
+    default:
+        return DT_UNKNOWN;
+    }
+}
+
+/*
+ * write PACKAGE_INDEX_FNAME next to pkginfo. after a header line there is one
+ * line per file, sorted by name:
+ *   <type> <name>[\t<link text>]
+ */
+int
+write_pkg_index(char *pkg_dir)
+{
+    int ret = 0;
+    char *pkgfiles_dir, *index_file, *tmp_file;
+    struct pkg_file_list list = {0};
+    struct pkg_file *file;
+    struct stat tmp_stat;
+    struct timespec times[2];
+    FILE *f;
+
+    printf("indexing '%s'\n", pkg_dir);
+
+    f = NULL;
+    pkgfiles_dir = malloc(PATH_MAX);
+    index_file = malloc(PATH_MAX);
+    tmp_file = malloc(PATH_MAX);
+    if(pkgfiles_dir == NULL || index_file == NULL || tmp_file == NULL) {
+        perror("malloc failed");
+        ret = 1;
+        goto cleanup;
+    }
+    if(snprintf(pkgfiles_dir, PATH_MAX, "%s/%s", pkg_dir, PACKAGE_FILES_DIRNAME)
+            >= PATH_MAX
+        || snprintf(index_file, PATH_MAX, "%s/%s", pkg_dir, PACKAGE_INDEX_FNAME)
+            >= PATH_MAX
+        || snprintf(tmp_file, PATH_MAX, "%s.tmp", index_file) >= PATH_MAX) {
+        fprintf(stderr, "path in '%s' exceeds PATH_MAX\n", pkg_dir);
+        ret = 1;
+        goto cleanup;
+    }
+
+    /*
+     * the index is made before listing and given back that mtime once
+     * written. it comes from the same clock as directory mtimes, so any
+     * directory changed while or after listing is at least as new.
+     */
+    f = fopen(tmp_file, "w");
+    if(f == NULL) {
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to open '%s': %s\n", tmp_file, err);
+        ret = 1;
+        goto cleanup;
+    }
+    if(fstat(fileno(f), &tmp_stat)) {
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to stat file '%s' (%s)\n", tmp_file, err);
+        ret = 1;
+        goto cleanup;
+    }
+    if(list_pkg_files(pkgfiles_dir, &list)) {
+        ret = 1;
+        goto cleanup;
+    }
+
+    fprintf(f, "%s\n", PACKAGE_INDEX_HEADER);
+    for(size_t i = 0; i < list.count; i++) {
+        file = &list.files[i];
+        if(strpbrk(file->name, "\t\n") != NULL
+            || (file->link != NULL && strchr(file->link, '\n') != NULL)) {
+            fprintf(stderr, "can not index '%s'\n", file->name);
+            ret = 1;
+            goto cleanup;
+        }
+        if(file->link != NULL)
+            fprintf(f, "%c %s\t%s\n",
+                index_type_char(file->type), file->name, file->link);
+        else
+            fprintf(f, "%c %s\n", index_type_char(file->type), file->name);
+    }
+    if(fflush(f) == EOF || ferror(f)) {
+        fprintf(stderr, "failed to write '%s'\n", tmp_file);
+        ret = 1;
+        goto cleanup;
+    }
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1] = tmp_stat.st_mtim;
+    if(futimens(fileno(f), times)) {
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to set mtime of '%s': %s\n", tmp_file, err);
+        ret = 1;
+        goto cleanup;
+    }
+    if(fclose(f)) {
+        f = NULL;
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to write '%s': %s\n", tmp_file, err);
+        ret = 1;
+        goto cleanup;
+    }
+    f = NULL;
+    if(rename(tmp_file, index_file)) {
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to rename '%s': %s\n", tmp_file, err);
+        ret = 1;
+        goto cleanup;
+    }
+
+cleanup:
+    if(f != NULL) {
+        fclose(f);
+        remove(tmp_file);
+    }
+    pkg_file_list_free(&list);
+    free(pkgfiles_dir);
+    free(index_file);
+    free(tmp_file);
+    return ret;
+}
+
+/*
+ * an entry can only appear or vanish by changing its directory's mtime.
+ * timestamps are coarse, so a directory as new as the index may have
+ * changed after it was listed and counts as stale.
+ */
+int
+index_is_newer(struct stat *index_stat, char *dir)
+{
+    struct stat dir_stat;
+
+    if(stat(dir, &dir_stat))
+        return 0;
+    if(dir_stat.st_mtim.tv_sec != index_stat->st_mtim.tv_sec)
+        return dir_stat.st_mtim.tv_sec < index_stat->st_mtim.tv_sec;
+    return dir_stat.st_mtim.tv_nsec < index_stat->st_mtim.tv_nsec;
+}
+
+/*
+ * read the package index into list. *valid is cleared, without error, if
+ * there is no index or a directory of pkgfiles changed after it was written.
+ * only the directories are stat'd, none are listed.
+ */
+int
+read_pkg_index(
+    char *pkg_dir,
+    char *pkgfiles_dir,
+    struct pkg_file_list *list,
+    int *valid)
+{
+    int ret = 0;
+    int fd;
+    size_t header_len;
+    char *index_file, *dir, *map, *p, *end, *line_end, *name, *tab;
+    struct stat index_stat;
+
+    *valid = 0;
+    fd = -1;
+    map = MAP_FAILED;
+    index_file = malloc(PATH_MAX);
+    dir = malloc(PATH_MAX);
+    if(index_file == NULL || dir == NULL) {
+        perror("malloc failed");
+        ret = 1;
+        goto cleanup;
+    }
+    if(snprintf(index_file, PATH_MAX, "%s/%s", pkg_dir, PACKAGE_INDEX_FNAME)
+            >= PATH_MAX) {
+        fprintf(stderr,
+            "'%s' in '%s' exceeds PATH_MAX\n", PACKAGE_INDEX_FNAME, pkg_dir);
+        ret = 1;
+        goto cleanup;
+    }
+
+    fd = open(index_file, O_RDONLY);
+    if(fd < 0) {
+        if(errno == ENOENT)
+            goto cleanup;
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to open '%s': %s\n", index_file, err);
+        ret = 1;
+        goto cleanup;
+    }
+    if(fstat(fd, &index_stat)) {
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to stat file '%s' (%s)\n", index_file, err);
+        ret = 1;
+        goto cleanup;
+    }
+    if(!index_is_newer(&index_stat, pkgfiles_dir))
+        goto stale;
+    header_len = strlen(PACKAGE_INDEX_HEADER);
+    if(index_stat.st_size <= header_len)
+        goto stale;
+    map = mmap(NULL, index_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(map == MAP_FAILED) {
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to map '%s': %s\n", index_file, err);
+        ret = 1;
+        goto cleanup;
+    }
+    end = map + index_stat.st_size;
+    if(strncmp(map, PACKAGE_INDEX_HEADER, header_len) != 0
+        || map[header_len] != '\n')
+        goto stale;
+
+    for(p = map + header_len + 1; p < end; p = line_end + 1) {
+        line_end = memchr(p, '\n', end - p);
+        if(line_end == NULL || line_end - p < 3 || p[1] != ' ')
+            goto stale;
+        name = p + 2;
+        tab = memchr(name, '\t', line_end - name);
+        if(pkg_file_list_push(list, name,
+                (tab == NULL ? line_end : tab) - name, index_char_type(p[0]),
+                tab == NULL ? NULL : tab + 1,
+                tab == NULL ? 0 : line_end - tab - 1)) {
+            ret = 1;
+            goto cleanup;
+        }
+        if(p[0] != 'd')
+            continue;
+        if(snprintf(dir, PATH_MAX, "%s/%s", pkgfiles_dir,
+                list->files[list->count - 1].name) >= PATH_MAX
+            || !index_is_newer(&index_stat, dir))
+            goto stale;
+    }
+    *valid = 1;
+    goto cleanup;
+
+stale:
+    fprintf(stderr, "index of '%s' is out of date, ignoring it\n", pkg_dir);
+    pkg_file_list_free(list);
+cleanup:
+    if(ret)
+        pkg_file_list_free(list);
+    if(map != MAP_FAILED)
+        munmap(map, index_stat.st_size);
+    if(fd >= 0)
+        close(fd);
+    free(index_file);
+    free(dir);
+    return ret;
+}
+
+/* list the files of a package from its index if valid, else from pkgfiles */
+int
+load_pkg_files(char *pkg_dir, char *pkgfiles_dir, struct pkg_file_list *list)
+{
+    int valid;
+
+    if(read_pkg_index(pkg_dir, pkgfiles_dir, list, &valid))
+        return 1;
+    if(valid)
+        return 0;
+    return list_pkg_files(pkgfiles_dir, list);
+}
+
+int
+index_pkgs(char **package_dirs, int package_count)
+{
+    int ret = 0;
+    for(int i = 0; i < package_count; i++)
+        if(write_pkg_index(package_dirs[i])) {
+            fprintf(stderr,
+                "failed to index package '%s'\n", package_dirs[i]);
+            ret = 1;
+        }
+    return ret;
+}
+
+/*
+ * a leading '/' is ignored and a trailing '/' only matches directories. a
+ * pattern without '/' is matched against the last path component, anything
+ * else against the whole name. patterns without wildcards are compared as
+ * strings.
+ */
+int
+filter_add_rule(struct filter *filter, char *pattern, int exclude)
+{
+    size_t len;
+    struct filter_rule *rules, *rule;
+
+    if(filter->count == filter->capacity) {
+        filter->capacity = filter->capacity ? filter->capacity * 2 : 16;
+        rules = realloc(filter->rules, filter->capacity * sizeof(*rules));
+        if(rules == NULL) {
+            perror("realloc failed");
+            return 1;
+        }
+        filter->rules = rules;
+    }
+    rule = &filter->rules[filter->count];
+    rule->exclude = exclude;
+    rule->flags = 0;
+    while(*pattern == '/') pattern++;
+    len = strlen(pattern);
+    if(len > 0 && pattern[len - 1] == '/') {
+        rule->flags |= FILTER_DIR_ONLY;
+        while(len > 0 && pattern[len - 1] == '/') len--;
+    }
+    if(len == 0) {
+        fprintf(stderr, "empty filter pattern\n");
+        return 1;
+    }
+    rule->pattern = strndup(pattern, len);
+    if(rule->pattern == NULL) {
+        perror("strndup failed");
+        return 1;
+    }
+    if(strchr(rule->pattern, '/') == NULL)
+        rule->flags |= FILTER_BASENAME;
+    if(strpbrk(rule->pattern, "*?[\\") == NULL)
+        rule->flags |= FILTER_LITERAL;
+    filter->count++;
+    return 0;
+}
+
+void
+filter_free(struct filter *filter)
+{
+    for(size_t i = 0; i < filter->count; i++)
+        free(filter->rules[i].pattern);
+    free(filter->rules);
+    filter->rules = NULL;
+    filter->count = filter->capacity = 0;
+}
+
+/* the last rule matching name decides, names no rule matches are kept */
+int
+filter_excludes(struct filter *filter, char *name, unsigned int type)
+{
+    char *base, *subject;
+    struct filter_rule *rule;
+
+    base = strrchr(name, '/');
+    base = base == NULL ? name : base + 1;
+    for(size_t i = filter->count; i > 0; i--) {
+        rule = &filter->rules[i - 1];
+        if((rule->flags & FILTER_DIR_ONLY) && type != DT_DIR)
+            continue;
+        subject = rule->flags & FILTER_BASENAME ? base : name;
+        if(rule->flags & FILTER_LITERAL
+                ? strcmp(rule->pattern, subject) == 0
+                : fnmatch(rule->pattern, subject, FNM_PATHNAME) == 0)
+            return rule->exclude;
+    }
+    return 0;
+}
+
+/* like filter_excludes, but name is also excluded by excluded parents */
+int
+filter_excludes_path(struct filter *filter, char *name, unsigned int type)
+{
+    int excluded = 0;
+    char *slash;
+
+    if(filter->count == 0)
+        return 0;
+    for(slash = strchr(name, '/'); slash != NULL && !excluded;
+            slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        excluded = filter_excludes(filter, name, DT_DIR);
+        *slash = '/';
+    }
+    return excluded || filter_excludes(filter, name, type);
+}
+
+/*
+ * the rules of a package are the include and exclude lines of its pkginfo,
+ * followed by those of base so the command line has the last word.
+ */
+int
+read_pkg_filter(char *pkg_dir, struct filter *base, struct filter *filter)
+{
+    int ret = 0;
+    size_t line_len;
+    char *info_file, *line;
+    FILE *f;
+
+    memset(filter, 0, sizeof(*filter));
+    f = NULL;
+    info_file = malloc(PATH_MAX);
+    line = malloc(PATH_MAX);
+    if(info_file == NULL || line == NULL) {
+        perror("malloc failed");
+        ret = 1;
+        goto cleanup;
+    }
+
+    if(snprintf(info_file, PATH_MAX, "%s/%s", pkg_dir, PACKAGE_INFO_FNAME)
+            >= PATH_MAX) {
+        fprintf(stderr,
+            "'%s' in '%s' exceeds PATH_MAX\n", PACKAGE_INFO_FNAME, pkg_dir);
+        ret = 1;
+        goto cleanup;
+    }
+    f = fopen(info_file, "r");
+    if(f == NULL && errno != ENOENT) {
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to open '%s': %s\n", info_file, err);
+        ret = 1;
+        goto cleanup;
+    }
+    while(f != NULL && fgets(line, PATH_MAX, f) != NULL) {
+        line_len = strlen(line);
+        if(line_len > 0 && line[line_len - 1] == '\n')
+            line[--line_len] = '\0';
+        if(strncmp(line, "include ", 8) == 0) {
+            if(filter_add_rule(filter, line + 8, 0)) {
+                ret = 1;
+                goto cleanup;
+            }
+        } else if(strncmp(line, "exclude ", 8) == 0) {
+            if(filter_add_rule(filter, line + 8, 1)) {
+                ret = 1;
+                goto cleanup;
+            }
+        }
+    }
+    if(f != NULL && ferror(f)) {
+        fprintf(stderr, "failed to read '%s'\n", info_file);
+        ret = 1;
+        goto cleanup;
+    }
+
+    for(size_t i = 0; i < base->count; i++)
+        if(filter_add_rule(filter, base->rules[i].pattern,
+                base->rules[i].exclude)) {
+            ret = 1;
+            goto cleanup;
+        }
+
+cleanup:
+    if(ret)
+        filter_free(filter);
+    if(f != NULL)
+        fclose(f);
+    free(info_file);
+    free(line);
+    return ret;
+}
+
+/*
+ * drop the excluded files from a sorted list in one pass. parents sort
+ * before their children, so by the time a file is reached any excluded
+ * directory above it has been seen and the rules need not be tried on it.
+ */
+int
+filter_pkg_files(struct filter *filter, struct pkg_file_list *list)
+{
+    int ret = 0;
+    int excluded;
+    size_t kept = 0;
+    char *slash;
+    struct pkg_file *file;
+    struct str_list skipped = {0};
+
+    if(filter->count == 0)
+        return 0;
+
+    for(size_t i = 0; i < list->count; i++) {
+        file = &list->files[i];
+        excluded = 0;
+        for(slash = strchr(file->name, '/'); slash != NULL && skipped.count > 0
+                && !excluded; slash = strchr(slash + 1, '/')) {
+            *slash = '\0';
+            excluded = str_list_contains(&skipped, file->name);
+            *slash = '/';
+        }
+        if(!excluded && filter_excludes(filter, file->name, file->type)) {
+            excluded = 1;
+            /* the list is sorted so skipped stays sorted */
+            if(file->type == DT_DIR && str_list_push(&skipped, file->name))
+                ret = 1;
+        }
+        if(excluded) {
+            free(file->name);
+            free(file->link);
+            continue;
+        }
+        list->files[kept++] = *file;
+    }
+    list->count = kept;
+
+    str_list_free(&skipped);
+    return ret;
+}
+
+/* the files of a package that are installed, given the package's rules */
+int
+load_filtered_pkg_files(
+    char *pkg_dir,
+    char *pkgfiles_dir,
+    struct filter *base,
+    struct pkg_file_list *list)
+{
+    int ret = 0;
+    struct filter filter;
+
+    if(read_pkg_filter(pkg_dir, base, &filter))
+        return 1;
+    if(load_pkg_files(pkg_dir, pkgfiles_dir, list)
+        || filter_pkg_files(&filter, list))
+        ret = 1;
+    filter_free(&filter);
+    return ret;
+}
+
+/* links made by install point into a package's pkgfiles directory */
+int
+is_store_link(char *link)
+{
+    size_t len = strlen(PACKAGE_FILES_DIRNAME);
+    char *p = link;
+
+    while((p = strstr(p, PACKAGE_FILES_DIRNAME)) != NULL) {
+        if((p == link || p[-1] == '/') && (p[len] == '/' || p[len] == '\0'))
+            return 1;
+        p += len;
+    }
+    return 0;
+}
+
+/* join a name below the target to a directory name below it, "" is the top */
+int
+gc_join(char *dir, char *name, char *buf)
+{
+    if(snprintf(buf, PATH_MAX, "%s%s%s", dir, dir[0] ? "/" : "", name)
+            >= PATH_MAX) {
+        fprintf(stderr, "file exceeded PATH_MAX in '%s'\n", dir);
+        return 1;
+    }
+    return 0;
+}
+
+/* remove the link name below the target, or say so in a dry run */
+int
+gc_remove_link(struct gc_ctx *ctx, char *name, char *link)
+{
+    if(ctx->dry_run) {
+        printf("would remove dangling link '%s/%s' -> '%s'\n", ctx->target,
+            name, link);
+    } else if(unlinkat(ctx->root_fd, name, 0)) {
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to remove symbolic link '%s/%s': %s\n",
+            ctx->target, name, err);
+        return 1;
+    } else {
+        printf("removed dangling link '%s/%s' -> '%s'\n", ctx->target, name,
+            link);
+    }
+    pthread_mutex_lock(&ctx->lock);
+    ctx->links++;
+    pthread_mutex_unlock(&ctx->lock);
+    return 0;
+}
+
+/* remove the emptied directory name below the target, gone is set if it went */
+int
+gc_remove_dir(struct gc_ctx *ctx, char *name, int *gone)
+{
+    *gone = 0;
+    if(ctx->dry_run) {
+        printf("would remove empty directory '%s/%s'\n", ctx->target, name);
+    } else if(unlinkat(ctx->root_fd, name, AT_REMOVEDIR)) {
+        if(errno == ENOTEMPTY || errno == EEXIST)
+            return 0;
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to remove directory '%s/%s': %s\n",
+            ctx->target, name, err);
+        return 1;
+    } else {
+        printf("removed empty directory '%s/%s'\n", ctx->target, name);
+    }
+    *gone = 1;
+    pthread_mutex_lock(&ctx->lock);
+    ctx->dirs_removed++;
+    pthread_mutex_unlock(&ctx->lock);
+    return 0;
+}
+
+/* queue the directory name for any worker, parent is NULL for the top */
+int
+gc_queue_dir(struct gc_ctx *ctx, struct gc_dir *parent, char *name)
+{
+    struct gc_dir *dir, **queue;
+
+    dir = malloc(sizeof(*dir));
+    if(dir == NULL) {
+        perror("malloc failed");
+        return 1;
+    }
+    dir->name = strdup(name);
+    if(dir->name == NULL) {
+        perror("strdup failed");
+        free(dir);
+        return 1;
+    }
+    dir->parent = parent;
+    dir->entries = dir->removed = 0;
+    dir->pending = 1;
+    dir->kept = 0;
+
+    pthread_mutex_lock(&ctx->lock);
+    if(ctx->queue_count == ctx->queue_capacity) {
+        ctx->queue_capacity = ctx->queue_capacity
+            ? ctx->queue_capacity * 2 : 64;
+        queue = realloc(ctx->queue, ctx->queue_capacity * sizeof(*queue));
+        if(queue == NULL) {
+            perror("realloc failed");
+            pthread_mutex_unlock(&ctx->lock);
+            free(dir->name);
+            free(dir);
+            return 1;
+        }
+        ctx->queue = queue;
+    }
+    ctx->queue[ctx->queue_count++] = dir;
+    if(parent != NULL)
+        parent->pending++;
+    pthread_cond_signal(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+    return 0;
+}
+
+/*
+ * scan one directory below the target. subdirectories are queued for any
+ * worker, dangling store links are removed and other dangling links kept
+ * for gc_remove_chains. other filesystems are not entered.
+ */
+int
+gc_scan_dir(struct gc_ctx *ctx, struct gc_dir *dir_entry)
+{
+    int ret = 0;
+    int fd, link_len;
+    long entries, removed;
+    unsigned int type;
+    char *name, *path, *link;
+    DIR *dir;
+    struct dirent *file;
+    struct stat st;
+
+    name = dir_entry->name;
+    entries = removed = 0;
+    dir = NULL;
+    fd = -1;
+    path = malloc(PATH_MAX);
+    link = malloc(PATH_MAX);
+    if(path == NULL || link == NULL) {
+        perror("malloc failed");
+        ret = 1;
+        goto cleanup;
+    }
+
+    fd = openat(ctx->root_fd, name[0] ? name : ".",
+        O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if(fd < 0 || fstat(fd, &st)) {
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to open directory '%s/%s' (%s)\n",
+            ctx->target, name, err);
+        ret = 1;
+        goto cleanup;
+    }
+    /* nothing removed, its parent counts it as an entry that remains */
+    if(st.st_dev != ctx->dev)
+        goto cleanup;
+    dir = fdopendir(fd);
+    if(dir == NULL) {
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to open directory '%s/%s' (%s)\n",
+            ctx->target, name, err);
+        ret = 1;
+        goto cleanup;
+    }
+    fd = -1;
+
+    while((file = readdir(dir)) != NULL) {
+        if(strcmp(file->d_name, ".") == 0 || strcmp(file->d_name, "..") == 0)
+            continue;
+        entries++;
+        if(gc_join(name, file->d_name, path)) {
+            ret = 1;
+            continue;
+        }
+        type = file->d_type;
+        if(type == DT_UNKNOWN) {
+            if(fstatat(dirfd(dir), file->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+                char *err = strerror(errno);
+                fprintf(stderr, "failed to stat file '%s/%s' (%s)\n",
+                    ctx->target, path, err);
+                ret = 1;
+                continue;
+            }
+            type = S_ISLNK(st.st_mode) ? DT_LNK
+                : S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+        }
+
+        if(type == DT_DIR) {
+            if(gc_queue_dir(ctx, dir_entry, path))
+                ret = 1;
+            continue;
+        }
+        if(type != DT_LNK)
+            continue;
+
+        link_len = readlinkat(dirfd(dir), file->d_name, link, PATH_MAX - 1);
+        if(link_len < 0) {
+            char *err = strerror(errno);
+            fprintf(stderr, "failed to read link of '%s/%s': %s\n",
+                ctx->target, path, err);
+            ret = 1;
+            continue;
+        }
+        link[link_len] = '\0';
+        if(fstatat(dirfd(dir), file->d_name, &st, 0) == 0)
+            continue;
+        if(errno != ENOENT && errno != ENOTDIR) {
+            char *err = strerror(errno);
+            fprintf(stderr, "failed to stat file '%s/%s' (%s)\n",
+                ctx->target, path, err);
+            continue;
+        }
+
+        pthread_mutex_lock(&ctx->lock);
+        if(!is_store_link(link)) {
+            if(pkg_file_list_push(&ctx->dangling, path, strlen(path), DT_LNK,
+                    link, link_len))
+                ret = 1;
+            dir_entry->kept = 1;
+            pthread_mutex_unlock(&ctx->lock);
+            continue;
+        }
+        if(str_list_push(&ctx->removed, path))
+            ret = 1;
+        pthread_mutex_unlock(&ctx->lock);
+        if(gc_remove_link(ctx, path, link)) {
+            ret = 1;
+            continue;
+        }
+        removed++;
+    }
+
+cleanup:
+    /* subdirectories finished already may have counted themselves */
+    pthread_mutex_lock(&ctx->lock);
+    dir_entry->entries = entries;
+    dir_entry->removed += removed;
+    pthread_mutex_unlock(&ctx->lock);
+    if(fd >= 0)
+        close(fd);
+    if(dir != NULL)
+        closedir(dir);
+    free(path);
+    free(link);
+    return ret;
+}
+
+/* keep the counts of dir for gc_remove_chains, taking its name */
+int
+gc_keep_dir(struct gc_ctx *ctx, struct gc_dir *dir)
+{
+    struct gc_dir_stat *dirs;
+
+    pthread_mutex_lock(&ctx->lock);
+    if(ctx->dir_count == ctx->dir_capacity) {
+        ctx->dir_capacity = ctx->dir_capacity ? ctx->dir_capacity * 2 : 64;
+        dirs = realloc(ctx->dirs, ctx->dir_capacity * sizeof(*dirs));
+        if(dirs == NULL) {
+            perror("realloc failed");
+            pthread_mutex_unlock(&ctx->lock);
+            return 1;
+        }
+        ctx->dirs = dirs;
+    }
+    ctx->dirs[ctx->dir_count].name = dir->name;
+    ctx->dirs[ctx->dir_count].entries = dir->entries;
+    ctx->dirs[ctx->dir_count].removed = dir->removed;
+    ctx->dir_count++;
+    dir->name = NULL;
+    pthread_mutex_unlock(&ctx->lock);
+    return 0;
+}
+
+/*
+ * drop one pending count of dir. once nothing below it is pending it is
+ * removed if this run emptied it, or kept if gc_remove_chains may still
+ * empty it, and freed. the same then goes for its parent.
+ */
+void
+gc_dir_done(struct gc_ctx *ctx, struct gc_dir *dir)
+{
+    int failed, gone;
+    struct gc_dir *parent;
+
+    gone = 0;
+    for(; dir != NULL; dir = parent) {
+        pthread_mutex_lock(&ctx->lock);
+        dir->removed += gone;
+        if(--dir->pending > 0) {
+            pthread_mutex_unlock(&ctx->lock);
+            return;
+        }
+        parent = dir->parent;
+        if(dir->kept && parent != NULL)
+            parent->kept = 1;
+        pthread_mutex_unlock(&ctx->lock);
+
+        failed = gone = 0;
+        if(dir->kept)
+            failed = gc_keep_dir(ctx, dir);
+        else if(dir->name[0] != '\0' && dir->removed > 0
+                && dir->removed == dir->entries)
+            failed = gc_remove_dir(ctx, dir->name, &gone);
+        if(failed) {
+            pthread_mutex_lock(&ctx->lock);
+            ctx->failed = 1;
+            pthread_mutex_unlock(&ctx->lock);
+        }
+        free(dir->name);
+        free(dir);
+    }
+}
+
+/*
+ * directories waiting to be scanned are shared out between the workers, so
+ * a tree that is mostly below one top level directory is still scanned in
+ * parallel. the scan is over once the queue is empty and no worker is busy.
+ */
+void *
+gc_worker(void *ctx)
+{
+    struct gc_ctx *gctx = ctx;
+    struct gc_dir *dir;
+
+    pthread_mutex_lock(&gctx->lock);
+    for(;;) {
+        while(gctx->queue_count == 0 && gctx->active > 0)
+            pthread_cond_wait(&gctx->cond, &gctx->lock);
+        if(gctx->queue_count == 0)
+            break;
+        dir = gctx->queue[--gctx->queue_count];
+        gctx->active++;
+        pthread_mutex_unlock(&gctx->lock);
+
+        if(gc_scan_dir(gctx, dir)) {
+            pthread_mutex_lock(&gctx->lock);
+            gctx->failed = 1;
+            pthread_mutex_unlock(&gctx->lock);
+        }
+        gc_dir_done(gctx, dir);
+
+        pthread_mutex_lock(&gctx->lock);
+        gctx->active--;
+    }
+    pthread_cond_broadcast(&gctx->cond);
+    pthread_mutex_unlock(&gctx->lock);
+    return NULL;
+}
+
+int
+gc_dir_stat_cmp(const void *a, const void *b)
+{
+    return strcmp(((struct gc_dir_stat *)a)->name,
+        ((struct gc_dir_stat *)b)->name);
+}
+
+/* the kept directory holding name, dirs must be sorted */
+struct gc_dir_stat *
+gc_find_parent(struct gc_ctx *ctx, char *name)
+{
+    char *slash, *parent;
+    struct gc_dir_stat key, *dir;
+
+    parent = strdup(name);
+    if(parent == NULL) {
+        perror("strdup failed");
+        return NULL;
+    }
+    slash = strrchr(parent, '/');
+    if(slash != NULL)
+        *slash = '\0';
+    else
+        parent[0] = '\0';
+    key.name = parent;
+    dir = bsearch(&key, ctx->dirs, ctx->dir_count, sizeof(*ctx->dirs),
+        gc_dir_stat_cmp);
+    free(parent);
+    return dir;
+}
+
+/*
+ * where the relative link name -> link points below the target, worked out
+ * from the names alone. returns 1 if it is absolute or leaves the target.
+ */
+int
+gc_link_target(char *name, char *link, char *buf)
+{
+    size_t len, part_len;
+    char *slash, *p, *end;
+
+    if(link[0] == '/')
+        return 1;
+    slash = strrchr(name, '/');
+    len = slash == NULL ? 0 : slash - name;
+    memcpy(buf, name, len);
+    for(p = link; *p != '\0'; p = *end == '/' ? end + 1 : end) {
+        end = strchr(p, '/');
+        if(end == NULL)
+            end = p + strlen(p);
+        part_len = end - p;
+        if(part_len == 0 || (part_len == 1 && p[0] == '.'))
+            continue;
+        if(part_len == 2 && p[0] == '.' && p[1] == '.') {
+            if(len == 0)
+                return 1;
+            while(len > 0 && buf[len - 1] != '/')
+                len--;
+            if(len > 0)
+                len--;
+            continue;
+        }
+        if(len + part_len + 2 > PATH_MAX)
+            return 1;
+        if(len > 0)
+            buf[len++] = '/';
+        memcpy(buf + len, p, part_len);
+        len += part_len;
+    }
+    buf[len] = '\0';
+    return len == 0;
+}
+
+/*
+ * links that do not point into a store, such as libe.so -> libe.so.1 copied
+ * from a package, dangle once the store link they point to is removed. they
+ * are removed too, pass after pass so whole chains go. dangling links that
+ * were not left by this run are kept.
+ */
+int
+gc_remove_chains(struct gc_ctx *ctx)
+{
+    int ret = 0;
+    char *target;
+    struct pkg_file *file;
+    struct gc_dir_stat *dir;
+    struct str_list found = {0};
+
+    target = malloc(PATH_MAX);
+    if(target == NULL) {
+        perror("malloc failed");
+        return 1;
+    }
+
+    do {
+        for(size_t i = 0; i < found.count; i++)
+            if(str_list_push(&ctx->removed, found.strs[i])) {
+                ret = 1;
+                goto cleanup;
+            }
+        str_list_free(&found);
+        str_list_sort(&ctx->removed);
+
+        for(size_t i = 0; i < ctx->dangling.count; i++) {
+            file = &ctx->dangling.files[i];
+            if(file->type != DT_LNK
+                || gc_link_target(file->name, file->link, target)
+                || !str_list_contains(&ctx->removed, target))
+                continue;
+            if(gc_remove_link(ctx, file->name, file->link)) {
+                ret = 1;
+                continue;
+            }
+            file->type = DT_UNKNOWN;
+            if(str_list_push(&found, file->name)) {
+                ret = 1;
+                goto cleanup;
+            }
+            dir = gc_find_parent(ctx, file->name);
+            if(dir != NULL)
+                dir->removed++;
+        }
+    } while(found.count > 0);
+
+cleanup:
+    str_list_free(&found);
+    free(target);
+    return ret;
+}
+
+/*
+ * remove kept directories emptied by this run, the rest were pruned during
+ * the scan. sorted, children come after their parent, so one reverse pass
+ * removes whole emptied trees. the top of the target is kept.
+ */
+int
+gc_prune_dirs(struct gc_ctx *ctx)
+{
+    int ret = 0;
+    int gone;
+    struct gc_dir_stat *dir, *parent;
+
+    for(size_t i = ctx->dir_count; i > 0; i--) {
+        dir = &ctx->dirs[i - 1];
+        if(dir->name[0] == '\0' || dir->removed == 0
+            || dir->removed < dir->entries)
+            continue;
+        if(gc_remove_dir(ctx, dir->name, &gone)) {
+            ret = 1;
+            continue;
+        }
+        if(!gone)
+            continue;
+        parent = gc_find_parent(ctx, dir->name);
+        if(parent != NULL)
+            parent->removed++;
+    }
+    return ret;
+}
+
+/*
+ * remove links into package stores whose targets no longer exist, left
+ * behind when a package directory is deleted without being uninstalled,
+ * along with the links and directories that leaves dangling or empty.
+ */
+int
+gc(char *target, int dry_run)
+{
+    int ret = 0;
+    long thread_count, started;
+    pthread_t *threads;
+    struct gc_ctx ctx;
+    struct stat st;
+
+    printf("collecting dangling links in '%s'\n", target);
+
+    threads = NULL;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.target = target;
+    ctx.dry_run = dry_run;
+    pthread_mutex_init(&ctx.lock, NULL);
+    pthread_cond_init(&ctx.cond, NULL);
+
+    ctx.root_fd = open(target, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(ctx.root_fd < 0 || fstat(ctx.root_fd, &st)) {
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to open directory '%s' (%s)\n", target, err);
+        ret = 1;
+        goto cleanup;
+    }
+    ctx.dev = st.st_dev;
+    if(gc_queue_dir(&ctx, NULL, "")) {
+        ret = 1;
+        goto cleanup;
+    }
+
+    thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if(thread_count < 1)
+        thread_count = 1;
+    threads = malloc(thread_count * sizeof(*threads));
+    if(threads == NULL) {
+        perror("malloc failed");
+        ret = 1;
+        goto cleanup;
+    }
+    for(started = 0; started < thread_count; started++)
+        if(pthread_create(&threads[started], NULL, gc_worker, &ctx)) {
+            fprintf(stderr, "failed to create scanning thread\n");
+            break;
+        }
+    if(started == 0)
+        gc_worker(&ctx);
+    for(long i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    if(ctx.failed)
+        ret = 1;
+
+    qsort(ctx.dirs, ctx.dir_count, sizeof(*ctx.dirs), gc_dir_stat_cmp);
+    if(gc_remove_chains(&ctx) || gc_prune_dirs(&ctx))
+        ret = 1;
+
+    printf("%s %lu dangling links and %lu empty directories\n",
+        dry_run ? "would remove" : "removed", ctx.links, ctx.dirs_removed);
+
+cleanup:
+    if(ctx.root_fd >= 0)
+        close(ctx.root_fd);
+    for(size_t i = 0; i < ctx.dir_count; i++)
+        free(ctx.dirs[i].name);
+    free(ctx.dirs);
+    for(size_t i = 0; i < ctx.queue_count; i++) {
+        free(ctx.queue[i]->name);
+        free(ctx.queue[i]);
+    }
+    free(ctx.queue);
+    str_list_free(&ctx.removed);
+    pkg_file_list_free(&ctx.dangling);
+    pthread_cond_destroy(&ctx.cond);
+    pthread_mutex_destroy(&ctx.lock);
+    free(threads);
+    return ret;
+}
+
+int
+str_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char **)a, *(char **)b);
+}
+
+int
+str_list_push(struct str_list *list, char *str)
+{
+    char **strs;
+
+    if(list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 16;
+        strs = realloc(list->strs, list->capacity * sizeof(*strs));
+        if(strs == NULL) {
+            perror("realloc failed");
+            return 1;
+        }
+        list->strs = strs;
+    }
+    list->strs[list->count] = strdup(str);
+    if(list->strs[list->count] == NULL) {
+        perror("strdup failed");
+        return 1;
+    }
+    list->count++;
+    return 0;
+}
+
+/* sort and drop duplicates */
+void
+str_list_sort(struct str_list *list)
+{
+    size_t i, j;
+
+    qsort(list->strs, list->count, sizeof(*list->strs), str_cmp);
+    for(i = j = 0; i < list->count; i++) {
+        if(j > 0 && strcmp(list->strs[j - 1], list->strs[i]) == 0) {
+            free(list->strs[i]);
+            continue;
+        }
+        list->strs[j++] = list->strs[i];
+    }
+    list->count = j;
+}
+
+int
+str_list_contains(struct str_list *list, char *str)
+{
+    return bsearch(&str, list->strs, list->count, sizeof(*list->strs),
+        str_cmp) != NULL;
+}
+
+void
+str_list_free(struct str_list *list)
+{
+    for(size_t i = 0; i < list->count; i++)
+        free(list->strs[i]);
+    free(list->strs);
+    list->strs = NULL;
+    list->count = list->capacity = 0;
+}
+
+/*
+ * read a list of package directories, one per line. blank lines and lines
+ * starting with '#' are skipped. with resolve every directory is made real
+ * so lists written from different working directories compare equal, else
+ * lines are kept as written; the installed record is already real and may
+ * name packages that have since been deleted. a missing file is an empty
+ * list if missing_ok is set.
+ */
+int
+read_pkg_list(
+    char *file_name, struct str_list *list, int missing_ok, int resolve)
+{
+    int ret = 0;
+    char *line, *real_pkg_dir;
+    size_t line_len;
+    FILE *f;
+
+    line = real_pkg_dir = NULL;
+    f = fopen(file_name, "r");
+    if(f == NULL) {
+        if(errno == ENOENT && missing_ok)
+            return 0;
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to open '%s': %s\n", file_name, err);
+        return 1;
+    }
+    real_pkg_dir = malloc(PATH_MAX);
+    line = malloc(PATH_MAX);
+    if(real_pkg_dir == NULL || line == NULL) {
+        perror("malloc failed");
+        ret = 1;
+        goto cleanup;
+    }
+
+    while(fgets(line, PATH_MAX, f) != NULL) {
+        line_len = strlen(line);
+        if(line_len > 0 && line[line_len - 1] == '\n')
+            line[--line_len] = '\0';
+        if(line_len == 0 || line[0] == '#')
+            continue;
+        if(resolve && realpath(line, real_pkg_dir) == NULL) {
+            char *err = strerror(errno);
+            fprintf(stderr, "failed to get real path of '%s': %s\n", line, err);
+            ret = 1;
+            goto cleanup;
+        }
+        if(str_list_push(list, resolve ? real_pkg_dir : line)) {
+            ret = 1;
+            goto cleanup;
+        }
+    }
+    if(ferror(f)) {
+        fprintf(stderr, "failed to read '%s'\n", file_name);
+        ret = 1;
+        goto cleanup;
+    }
+    str_list_sort(list);
+
+cleanup:
+    fclose(f);
+    free(line);
+    free(real_pkg_dir);
+    return ret;
+}
+
+/*
+ * make the directories leading to name in the STATE_DIR of install_dir and
+ * write the path of name to buf.
+ */
+int
+state_path(char *install_dir, char *name, char *buf)
+{
+    char *slash;
+
+    if(snprintf(buf, PATH_MAX, "%s/%s/%s", install_dir, STATE_DIR, name)
+            >= PATH_MAX) {
+        fprintf(stderr,
+            "path exceeds PATH_MAX somewhere in '%s'\n", install_dir);
+        return 1;
+    }
+    slash = buf + strlen(install_dir);
+    while((slash = strchr(slash + 1, '/')) != NULL) {
+        *slash = '\0';
+        if(touch_dir(buf))
+            return 1;
+        *slash = '/';
+    }
+    return 0;
+}
+
+/*
+ * open and flock name in the STATE_DIR of install_dir, returning the
+ * descriptor or -1. if wait is not set errno is EWOULDBLOCK when the lock is
+ * held elsewhere, which is not reported.
+ */
+int
+take_lock(char *install_dir, char *name, int exclusive, int wait)
+{
+    int fd = -1;
+    int op;
+    char *lock_file;
+
+    lock_file = malloc(PATH_MAX);
+    if(lock_file == NULL) {
+        perror("malloc failed");
+        goto cleanup;
+    }
+    if(state_path(install_dir, name, lock_file))
+        goto cleanup;
+    fd = open(lock_file, O_RDONLY | O_CREAT | O_CLOEXEC, 0644);
+    if(fd < 0) {
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to open '%s': %s\n", lock_file, err);
+        goto cleanup;
+    }
+    op = (exclusive ? LOCK_EX : LOCK_SH) | (wait ? 0 : LOCK_NB);
+    while(flock(fd, op)) {
+        if(errno == EINTR)
+            continue;
+        if(errno != EWOULDBLOCK) {
+            char *err = strerror(errno);
+            fprintf(stderr, "failed to lock '%s': %s\n", lock_file, err);
+        }
+        close(fd);
+        fd = -1;
+        break;
+    }
+
+cleanup:
+    free(lock_file);
+    return fd;
+}
+
+/*
+ * lock the whole of install_dir. installs and uninstalls share it and lock
+ * the paths they change, gc and sync take it exclusively.
+ */
+int
+lock_target(char *install_dir, int exclusive, int wait)
+{
+    int fd;
+
+    fd = take_lock(install_dir, TARGET_LOCK_FNAME, exclusive, wait);
+    if(fd < 0 && errno == EWOULDBLOCK)
+        fprintf(stderr, "'%s' is in use by another mypkg\n", install_dir);
+    return fd;
+}
+
+/* lock file name of a path range, '/' and '%' are escaped */
+int
+path_lock_name(char *key, char *buf)
+{
+    int len;
+
+    len = snprintf(buf, PATH_MAX, "%s/", PATH_LOCKS_DIRNAME);
+    for(; *key; key++) {
+        if(len >= NAME_MAX + strlen(PATH_LOCKS_DIRNAME) - 3)
+            return 1;
+        if(*key == '/' || *key == '%')
+            len += sprintf(&buf[len], "%%%02x", *key);
+        else
+            buf[len++] = *key;
+    }
+    buf[len] = '\0';
+    return 0;
+}
+
+/*
+ * the range of a file is its path up to the second component. writing the
+ * file locks its range exclusively and the top level directory above it
+ * shared, so that directory can not be removed under it. top level files
+ * lock themselves exclusively.
+ */
+int
+add_path_lock_keys(
+    struct pkg_file *file, struct str_list *shared, struct str_list *exclusive)
+{
+    int ret = 0;
+    char *key, *first, *second;
+
+    key = strdup(file->name);
+    if(key == NULL) {
+        perror("strdup failed");
+        return 1;
+    }
+    first = strchr(key, '/');
+    if(first == NULL) {
+        ret = str_list_push(file->type == DT_DIR ? shared : exclusive, key);
+        goto cleanup;
+    }
+    second = strchr(first + 1, '/');
+    if(second != NULL)
+        *second = '\0';
+    if(str_list_push(exclusive, key)) {
+        ret = 1;
+        goto cleanup;
+    }
+    *first = '\0';
+    ret = str_list_push(shared, key);
+
+cleanup:
+    free(key);
+    return ret;
+}
+
+/*
+ * lock the ranges of install_dir the files in list are in. locks are taken
+ * in name order so mypkg processes never wait on each other in a cycle.
+ */
+int
+lock_paths(
+    char *install_dir,
+    struct pkg_file_list *list,
+    int wait,
+    struct lock_set *locks)
+{
+    int ret = 0;
+    int fd, exclusive;
+    size_t i, j;
+    char *lock_name, *key;
+    struct str_list shared = {0}, excl = {0};
+
+    locks->fds = NULL;
+    locks->count = 0;
+    lock_name = malloc(PATH_MAX);
+    if(lock_name == NULL) {
+        perror("malloc failed");
+        ret = 1;
+        goto cleanup;
+    }
+    for(i = 0; i < list->count; i++)
+        if(add_path_lock_keys(&list->files[i], &shared, &excl)) {
+            ret = 1;
+            goto cleanup;
+        }
+    str_list_sort(&shared);
+    str_list_sort(&excl);
+
+    locks->fds = malloc((shared.count + excl.count + 1) * sizeof(int));
+    if(locks->fds == NULL) {
+        perror("malloc failed");
+        ret = 1;
+        goto cleanup;
+    }
+    for(i = j = 0; i < shared.count || j < excl.count;) {
+        if(j == excl.count
+            || (i < shared.count && strcmp(shared.strs[i], excl.strs[j]) < 0)) {
+            key = shared.strs[i++];
+            exclusive = 0;
+        } else {
+            if(i < shared.count && strcmp(shared.strs[i], excl.strs[j]) == 0)
+                i++;
+            key = excl.strs[j++];
+            exclusive = 1;
+        }
+        if(path_lock_name(key, lock_name)) {
+            fprintf(stderr, "lock name of '%s' is too long\n", key);
+            ret = 1;
+            goto cleanup;
+        }
+        fd = take_lock(install_dir, lock_name, exclusive, wait);
+        if(fd < 0) {
+            if(errno == EWOULDBLOCK)
+                fprintf(stderr, "'%s' in '%s' is in use by another mypkg\n",
+                    key, install_dir);
+            ret = 1;
+            goto cleanup;
+        }
+        locks->fds[locks->count++] = fd;
+    }
+
+cleanup:
+    if(ret)
+        unlock_paths(locks);
+    str_list_free(&shared);
+    str_list_free(&excl);
+    free(lock_name);
+    return ret;
+}
+
+void
+unlock_paths(struct lock_set *locks)
+{
+    for(size_t i = 0; i < locks->count; i++)
+        close(locks->fds[i]);
+    free(locks->fds);
+    locks->fds = NULL;
+    locks->count = 0;
+}
+
+/*
+ * record in install_dir which packages were added and removed, so sync can
+ * tell what is installed without looking at the packages.
+ */
+int
+update_installed(
+    char *install_dir,
+    char **added,
+    int added_count,
+    char **removed,
+    int removed_count,
+    int wait)
+{
+    int ret = 0;
+    int lock_fd;
+    char *list_file, *tmp_file, *real_pkg_dir;
+    struct str_list installed = {0}, removed_list = {0};
+    FILE *f;
+
+    if(added_count == 0 && removed_count == 0)
+        return 0;
+
+    f = NULL;
+    lock_fd = take_lock(install_dir, INSTALLED_LOCK_FNAME, 1, wait);
+    if(lock_fd < 0) {
+        if(errno == EWOULDBLOCK)
+            fprintf(stderr, "installed record of '%s' is in use\n",
+                install_dir);
+        return 1;
+    }
+    list_file = malloc(PATH_MAX);
+    tmp_file = malloc(PATH_MAX);
+    real_pkg_dir = malloc(PATH_MAX);
+    if(list_file == NULL || tmp_file == NULL || real_pkg_dir == NULL) {
+        perror("malloc failed");
+        ret = 1;
+        goto cleanup;
+    }
+    if(state_path(install_dir, INSTALLED_LIST_FNAME, list_file)) {
+        ret = 1;
+        goto cleanup;
+    }
+    if(snprintf(tmp_file, PATH_MAX, "%s.tmp", list_file) >= PATH_MAX) {
+        fprintf(stderr, "path exceeds PATH_MAX '%s'\n", list_file);
+        ret = 1;
+        goto cleanup;
+    }
+    if(read_pkg_list(list_file, &installed, 1, 0)) {
+        ret = 1;
+        goto cleanup;
+    }
+
+    /*
+     * a removed package that no longer exists can only be named as it was
+     * recorded, so it is dropped by that string.
+     */
+    for(int i = 0; i < added_count + removed_count; i++) {
+        char *pkg_dir = i < added_count ? added[i] : removed[i - added_count];
+        if(realpath(pkg_dir, real_pkg_dir) == NULL) {
+            if(i >= added_count && errno == ENOENT) {
+                if(str_list_push(&removed_list, pkg_dir)) {
+                    ret = 1;
+                    goto cleanup;
+                }
+                continue;
+            }
+            char *err = strerror(errno);
+            fprintf(stderr,
+                "failed to get real path of '%s': %s\n", pkg_dir, err);
+            ret = 1;
+            goto cleanup;
+        }
+        if(str_list_push(i < added_count ? &installed : &removed_list,
+                real_pkg_dir)) {
+            ret = 1;
+            goto cleanup;
+        }
+    }
+    str_list_sort(&installed);
+    str_list_sort(&removed_list);
+
+    f = fopen(tmp_file, "w");
+    if(f == NULL) {
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to open '%s': %s\n", tmp_file, err);
+        ret = 1;
+        goto cleanup;
+    }
+    for(size_t i = 0; i < installed.count; i++)
+        if(!str_list_contains(&removed_list, installed.strs[i]))
+            fprintf(f, "%s\n", installed.strs[i]);
+    if(ferror(f)) {
+        fprintf(stderr, "failed to write '%s'\n", tmp_file);
+        ret = 1;
+        goto cleanup;
+    }
+    if(fclose(f)) {
+        f = NULL;
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to write '%s': %s\n", tmp_file, err);
+        ret = 1;
+        goto cleanup;
+    }
+    f = NULL;
+    if(rename(tmp_file, list_file)) {
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to rename '%s': %s\n", tmp_file, err);
+        ret = 1;
+        goto cleanup;
+    }
+
+cleanup:
+    if(f != NULL) {
+        fclose(f);
+        remove(tmp_file);
+    }
+    close(lock_fd);
+    str_list_free(&installed);
+    str_list_free(&removed_list);
+    free(list_file);
+    free(tmp_file);
+    free(real_pkg_dir);
+    return ret;
+}
+
+/*
+ * make install_dir hold exactly the packages listed in list_file. only
+ * packages missing from the installed list are installed and only those no
+ * longer wanted are uninstalled, the rest are not looked at.
+ */
+int
+sync_pkgs(char *list_file, char *install_dir, struct install_opts *opts)
+{
+    int ret = 0;
+    int added_count, removed_count, gone_count;
+    char *installed_file, **added, **removed, **gone;
+    struct str_list wanted = {0}, installed = {0};
+    struct stat st;
+
+    added = removed = gone = NULL;
+    installed_file = malloc(PATH_MAX);
+    if(installed_file == NULL) {
+        perror("malloc failed");
+        ret = 1;
+        goto cleanup;
+    }
+    if(state_path(install_dir, INSTALLED_LIST_FNAME, installed_file)) {
+        ret = 1;
+        goto cleanup;
+    }
+    if(read_pkg_list(list_file, &wanted, 0, 1)
+        || read_pkg_list(installed_file, &installed, 1, 0)) {
+        ret = 1;
+        goto cleanup;
+    }
+
+    added = malloc((wanted.count + 1) * sizeof(*added));
+    removed = malloc((installed.count + 1) * sizeof(*removed));
+    gone = malloc((installed.count + 1) * sizeof(*gone));
+    if(added == NULL || removed == NULL || gone == NULL) {
+        perror("malloc failed");
+        ret = 1;
+        goto cleanup;
+    }
+    added_count = removed_count = gone_count = 0;
+    for(size_t i = 0; i < wanted.count; i++)
+        if(!str_list_contains(&installed, wanted.strs[i]))
+            added[added_count++] = wanted.strs[i];
+    /* without its pkgfiles a deleted package's links cannot be listed */
+    for(size_t i = 0; i < installed.count; i++) {
+        if(str_list_contains(&wanted, installed.strs[i]))
+            continue;
+        if(stat(installed.strs[i], &st) < 0 && errno == ENOENT) {
+            fprintf(stderr, "'%s' no longer exists, dropping it from the "
+                "record; run 'mypkg gc' to remove its links\n",
+                installed.strs[i]);
+            gone[gone_count++] = installed.strs[i];
+        } else {
+            removed[removed_count++] = installed.strs[i];
+        }
+    }
+
+    printf("syncing '%s': %d to install, %d to uninstall, %zu unchanged\n",
+        install_dir, added_count, removed_count + gone_count,
+        wanted.count - added_count);
+
+    if(gone_count > 0
+        && update_installed(install_dir, NULL, 0, gone, gone_count,
+            opts->wait))
+        ret = 1;
+    if(removed_count > 0
+        && uninstall(removed, removed_count, &install_dir, 1, opts))
+        ret = 1;
+    if(added_count > 0
+        && install(added, added_count, &install_dir, 1, opts))
+        ret = 1;
+
+cleanup:
+    str_list_free(&wanted);
+    str_list_free(&installed);
+    free(installed_file);
+    free(added);
+    free(removed);
+    free(gone);
+    return ret;
+}
+
+/*
+ * find name in a sorted list. returns its index, or -1 - the index it would
+ * be inserted at.
+ */
+long
+pkg_file_list_find(struct pkg_file_list *list, char *name)
+{
+    size_t lo = 0, hi = list->count, mid;
+    int cmp;
+
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        cmp = strcmp(list->files[mid].name, name);
+        if(cmp == 0)
+            return mid;
+        if(cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return -1 - (long)lo;
+}
+
+void
+pkg_file_list_remove(struct pkg_file_list *list, size_t i)
+{
+    free(list->files[i].name);
+    free(list->files[i].link);
+    memmove(&list->files[i], &list->files[i + 1],
+        (list->count - i - 1) * sizeof(*list->files));
+    list->count--;
+}
+
+/* watch the directory name of a package, returns the watch descriptor */
+int
+watch_add(struct watch_ctx *ctx, int pkg, char *name)
+{
+    int wd;
+    char *dir;
+    struct watch_dir *dirs;
+
+    dir = malloc(PATH_MAX);
+    if(dir == NULL) {
+        perror("malloc failed");
+        return -1;
+    }
+    if(snprintf(dir, PATH_MAX, "%s/%s", ctx->pkgs[pkg].pkgfiles_dir, name)
+            >= PATH_MAX) {
+        fprintf(stderr, "path exceeds PATH_MAX '%s'\n", name);
+        wd = -1;
+        goto cleanup;
+    }
+    wd = inotify_add_watch(ctx->fd, dir, WATCH_MASK);
+    if(wd < 0) {
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to watch '%s': %s\n", dir, err);
+        goto cleanup;
+    }
+    if(wd >= ctx->dir_capacity) {
+        int capacity = ctx->dir_capacity ? ctx->dir_capacity : 64;
+        while(capacity <= wd)
+            capacity *= 2;
+        dirs = realloc(ctx->dirs, capacity * sizeof(*dirs));
+        if(dirs == NULL) {
+            perror("realloc failed");
+            wd = -1;
+            goto cleanup;
+        }
+        for(int i = ctx->dir_capacity; i < capacity; i++) {
+            dirs[i].pkg = -1;
+            dirs[i].name = NULL;
+        }
+        ctx->dirs = dirs;
+        ctx->dir_capacity = capacity;
+    }
+    /* a directory moved within the package keeps its descriptor */
+    free(ctx->dirs[wd].name);
+    ctx->dirs[wd].pkg = pkg;
+    ctx->dirs[wd].name = strdup(name);
+    if(ctx->dirs[wd].name == NULL) {
+        perror("strdup failed");
+        ctx->dirs[wd].pkg = -1;
+        wd = -1;
+    }
+
+cleanup:
+    free(dir);
+    return wd;
+}
+
+/* watch a directory found while scanning and note it and its files changed */
+int
+watch_scan_file(char *src_file, unsigned int type, void *ctx)
+{
+    struct { struct watch_ctx *watch; int pkg; } *cast_ctx = ctx;
+    struct watch_pkg *pkg;
+    char *file_name;
+
+    pkg = &cast_ctx->watch->pkgs[cast_ctx->pkg];
+    file_name = remove_prefix(pkg->pkgfiles_dir, src_file);
+    if(file_name == NULL) {
+        fprintf(stderr, "src_file does not begin with src_dir\n");
+        return 1;
+    }
+    while(*file_name == '/') file_name++;
+    if(type == DT_DIR
+        && watch_add(cast_ctx->watch, cast_ctx->pkg, file_name) < 0)
+        return 1;
+    return pkg_file_list_push(&pkg->changes, file_name, strlen(file_name),
+        type, NULL, 0);
+}
+
+/*
+ * watch a directory and everything below it. files made before the watch
+ * existed would otherwise be missed, so all of them are noted as changed.
+ */
+int
+watch_add_tree(struct watch_ctx *ctx, int pkg, char *name)
+{
+    int ret = 0;
+    char *dir;
+    struct { struct watch_ctx *watch; int pkg; } scan_ctx;
+
+    dir = malloc(PATH_MAX);
+    if(dir == NULL) {
+        perror("malloc failed");
+        return 1;
+    }
+    if(watch_add(ctx, pkg, name) < 0) {
+        ret = 1;
+        goto cleanup;
+    }
+    if(snprintf(dir, PATH_MAX, "%s/%s", ctx->pkgs[pkg].pkgfiles_dir, name)
+            >= PATH_MAX) {
+        fprintf(stderr, "path exceeds PATH_MAX '%s'\n", name);
+        ret = 1;
+        goto cleanup;
+    }
+    scan_ctx.watch = ctx;
+    scan_ctx.pkg = pkg;
+    if(find_recursive(dir, watch_scan_file, &scan_ctx)) {
+        ret = 1;
+        goto cleanup;
+    }
+
+cleanup:
+    free(dir);
+    return ret;
+}
+
+/* read the events that are ready and note which files they are about */
+int
+watch_read(struct watch_ctx *ctx, char *buf, int *overflow)
+{
+    ssize_t len;
+    char *p, *name;
+    struct inotify_event *event;
+    struct watch_dir *dir;
+
+    name = malloc(PATH_MAX);
+    if(name == NULL) {
+        perror("malloc failed");
+        return 1;
+    }
+    len = read(ctx->fd, buf, WATCH_BUF_SIZE);
+    if(len < 0) {
+        free(name);
+        if(errno == EAGAIN || errno == EINTR)
+            return 0;
+        perror("failed to read inotify events");
+        return 1;
+    }
+    for(p = buf; p < buf + len; p += sizeof(*event) + event->len) {
+        event = (struct inotify_event *)p;
+        if(event->mask & IN_Q_OVERFLOW) {
+            *overflow = 1;
+            continue;
+        }
+        if(event->wd < 0 || event->wd >= ctx->dir_capacity)
+            continue;
+        dir = &ctx->dirs[event->wd];
+        if(event->mask & IN_IGNORED) {
+            free(dir->name);
+            dir->name = NULL;
+            dir->pkg = -1;
+            continue;
+        }
+        if(dir->pkg < 0 || event->len == 0)
+            continue;
+        if(snprintf(name, PATH_MAX, "%s%s%s", dir->name,
+                dir->name[0] ? "/" : "", event->name) >= PATH_MAX)
+            continue;
+        if(pkg_file_list_push(&ctx->pkgs[dir->pkg].changes, name,
+                strlen(name), DT_UNKNOWN, NULL, 0)) {
+            free(name);
+            return 1;
+        }
+    }
+    free(name);
+    return 0;
+}
+
+/* remove name, and anything installed below it, from every target */
+int
+watch_remove(struct watch_ctx *ctx, struct watch_pkg *pkg, long i)
+{
+    int ret = 0;
+    size_t name_len, end;
+    struct link_dir_cache cache;
+
+    cache.dir = malloc(PATH_MAX);
+    cache.real_dir = malloc(PATH_MAX);
+    if(cache.dir == NULL || cache.real_dir == NULL) {
+        perror("malloc failed");
+        ret = 1;
+        goto cleanup;
+    }
+
+    name_len = strlen(pkg->files.files[i].name);
+    for(end = i + 1; end < pkg->files.count; end++)
+        if(strncmp(pkg->files.files[end].name, pkg->files.files[i].name,
+                name_len) != 0 || pkg->files.files[end].name[name_len] != '/')
+            break;
+
+    /* children first so directories are empty when they are reached */
+    while(end > (size_t)i) {
+        struct pkg_file *file = &pkg->files.files[--end];
+        for(int j = 0; j < ctx->install_count; j++) {
+            cache.dir[0] = cache.real_dir[0] = '\0';
+            if(uninstall_link(file, ctx->install_dirs[j],
+                    pkg->real_pkgfiles_dir, &cache)
+                || uninstall_directory(file, ctx->install_dirs[j]))
+                ret = 1;
+        }
+        printf("removed '%s'\n", file->name);
+        pkg_file_list_remove(&pkg->files, end);
+    }
+
+cleanup:
+    free(cache.dir);
+    free(cache.real_dir);
+    return ret;
+}
+
+/*
+ * install name as it is now, replacing what was installed for it before. a
+ * directory is rescanned along with what was installed below it, as it may
+ * have been replaced by another.
+ */
+int
+watch_install(struct watch_ctx *ctx, int pkg_index, char *name, struct stat *st)
+{
+    int ret = 0;
+    int link_len;
+    long i;
+    char *src_file, *link, *real_first_dir, *real_install_dir;
+    struct watch_pkg *pkg;
+    struct pkg_file file, new_file, *old;
+    struct link_dir_cache cache;
+
+    pkg = &ctx->pkgs[pkg_index];
+    file.name = name;
+    file.link = NULL;
+    file.target_link = NULL;
+    file.type = S_ISDIR(st->st_mode) ? DT_DIR : S_ISLNK(st->st_mode) ? DT_LNK
+        : S_ISREG(st->st_mode) ? DT_REG : DT_UNKNOWN;
+    if(filter_excludes_path(&pkg->filter, name, file.type))
+        return 0;
+    src_file = malloc(PATH_MAX);
+    link = malloc(PATH_MAX);
+    real_first_dir = malloc(PATH_MAX);
+    real_install_dir = malloc(PATH_MAX);
+    cache.dir = malloc(PATH_MAX);
+    cache.real_dir = malloc(PATH_MAX);
+    if(src_file == NULL || link == NULL || real_first_dir == NULL
+        || real_install_dir == NULL || cache.dir == NULL
+        || cache.real_dir == NULL) {
+        perror("malloc failed");
+        ret = 1;
+        goto cleanup;
+    }
+
+    if(file.type == DT_LNK) {
+        if(snprintf(src_file, PATH_MAX, "%s/%s", pkg->pkgfiles_dir, name)
+                >= PATH_MAX) {
+            fprintf(stderr, "path exceeds PATH_MAX '%s'\n", name);
+            ret = 1;
+            goto cleanup;
+        }
+        /* if it is gone again a later event will say so */
+        link_len = readlink(src_file, link, PATH_MAX - 1);
+        if(link_len < 0)
+            goto cleanup;
+        link[link_len] = '\0';
+        file.link = link;
+    }
+
+    i = pkg_file_list_find(&pkg->files, name);
+    if(i >= 0) {
+        old = &pkg->files.files[i];
+        if(old->type == DT_DIR && file.type == DT_DIR) {
+            size_t name_len = strlen(name);
+            for(size_t j = i + 1; j < pkg->files.count; j++) {
+                old = &pkg->files.files[j];
+                if(strncmp(old->name, name, name_len) != 0
+                    || old->name[name_len] != '/')
+                    break;
+                if(pkg_file_list_push(&pkg->changes, old->name,
+                        strlen(old->name), DT_UNKNOWN, NULL, 0)) {
+                    ret = 1;
+                    goto cleanup;
+                }
+            }
+            if(watch_add_tree(ctx, pkg_index, name))
+                ret = 1;
+            goto cleanup;
+        }
+        if(old->type == file.type && (file.type != DT_LNK
+                || strcmp(old->link, file.link) == 0))
+            goto cleanup;
+        if(watch_remove(ctx, pkg, i)) {
+            ret = 1;
+            goto cleanup;
+        }
+    }
+
+    if(realpath(ctx->install_dirs[0], real_first_dir) == NULL) {
+        char *err = strerror(errno);
+        fprintf(stderr, "failed to get real path of '%s': %s\n",
+            ctx->install_dirs[0], err);
+        ret = 1;
+        goto cleanup;
+    }
+    if(set_target_link(&file, pkg->real_pkgfiles_dir, real_first_dir,
+            ctx->opts->flatten_links)) {
+        ret = 1;
+        goto cleanup;
+    }
+    for(int j = 0; j < ctx->install_count; j++) {
+        cache.dir[0] = cache.real_dir[0] = '\0';
+        if(install_file(&file, ctx->install_dirs[j],
+                shared_link_target(ctx->install_dirs[j], real_first_dir,
+                    pkg->real_pkgfiles_dir, real_install_dir),
+                pkg->real_pkgfiles_dir, &cache)) {
+            ret = 1;
+            goto cleanup;
+        }
+    }
+    printf("installed '%s'\n", name);
+
+    /* add the new entry at its sorted place */
+    i = -1 - pkg_file_list_find(&pkg->files, name);
+    if(pkg_file_list_push(&pkg->files, name, strlen(name), file.type,
+            file.link, file.link ? strlen(file.link) : 0)) {
+        ret = 1;
+        goto cleanup;
+    }
+    new_file = pkg->files.files[pkg->files.count - 1];
+    memmove(&pkg->files.files[i + 1], &pkg->files.files[i],
+        (pkg->files.count - 1 - i) * sizeof(*pkg->files.files));
+    pkg->files.files[i] = new_file;
+
+    if(file.type == DT_DIR && watch_add_tree(ctx, pkg_index, name))
+        ret = 1;
+
+cleanup:
+    free(src_file);
+    free(link);
+    free(real_first_dir);
+    free(real_install_dir);
+    free(file.target_link);
+    free(cache.dir);
+    free(cache.real_dir);
+    return ret;
+}
+
+/*
+ * bring every target in line with the noted changes of a package. a file is
+ * looked at once however many events named it; if it is gone it is removed,
+ * otherwise it is installed as it is now.
+ */
+int
+watch_apply(struct watch_ctx *ctx, int pkg_index)
+{
+    int ret = 0;
+    long i;
+    size_t j, done, end;
+    char *src_file, *name;
+    struct watch_pkg *pkg;
+    struct pkg_file_list *changes, pass;
+    struct stat st;
+    struct lock_set *locks;
+
+    pkg = &ctx->pkgs[pkg_index];
+    changes = &pkg->changes;
+    src_file = malloc(PATH_MAX);
+    locks = calloc(ctx->install_count, sizeof(*locks));
+    if(src_file == NULL || locks == NULL) {
+        perror("malloc failed");
+        ret = 1;
+        goto cleanup;
+    }
+
+    qsort(changes->files, changes->count, sizeof(*changes->files),
+        pkg_file_cmp);
+    for(size_t k = j = 0; k < changes->count; k++) {
+        if(j > 0 && strcmp(changes->files[k].name,
+                changes->files[j - 1].name) == 0) {
+            free(changes->files[k].name);
+            continue;
+        }
+        changes->files[j++] = changes->files[k];
+    }
+    changes->count = j;
+
+    /*
+     * sorted, a directory comes before what is in it. removing it removes
+     * everything installed below it too, and a new directory adds its
+     * contents to the end of changes while a pass runs. those are applied
+     * by the next pass, under locks of their own.
+     */
+    for(done = 0; done < changes->count; done = end) {
+        end = changes->count;
+        pass.files = &changes->files[done];
+        pass.count = end - done;
+        for(int t = 0; t < ctx->install_count; t++)
+            if(lock_paths(ctx->install_dirs[t], &pass, ctx->opts->wait,
+                    &locks[t])) {
+                ret = 1;
+                goto unapplied;
+            }
+
+        for(size_t k = done; k < end; k++) {
+            name = changes->files[k].name;
+            if(snprintf(src_file, PATH_MAX, "%s/%s", pkg->pkgfiles_dir, name)
+                    >= PATH_MAX)
+                continue;
+            if(lstat(src_file, &st) == 0) {
+                if(watch_install(ctx, pkg_index, name, &st))
+                    ret = 1;
+            } else if((i = pkg_file_list_find(&pkg->files, name)) >= 0) {
+                if(watch_remove(ctx, pkg, i))
+                    ret = 1;
+            }
+        }
+        for(int t = 0; t < ctx->install_count; t++)
+            unlock_paths(&locks[t]);
+    }
+
+cleanup:
+    pkg_file_list_free(changes);
+    free(locks);
+    free(src_file);
+    return ret;
+
+unapplied:
+    /* a busy range keeps what was not applied queued for the next round */
+    for(int t = 0; t < ctx->install_count; t++)
+        unlock_paths(&locks[t]);
+    for(size_t k = 0; k < done; k++)
+        free(changes->files[k].name);
+    memmove(changes->files, &changes->files[done],
+        (changes->count - done) * sizeof(*changes->files));
+    changes->count -= done;
+    free(locks);
+    free(src_file);
+    return ret;
+}
+
+/*
+ * after lost events every file installed or present is looked at again.
+ */
+int
+watch_resync(struct watch_ctx *ctx)
+{
+    struct watch_pkg *pkg;
+
+    fprintf(stderr, "inotify queue overflowed, rescanning packages\n");
+    for(int i = 0; i < ctx->pkg_count; i++) {
+        pkg = &ctx->pkgs[i];
+        for(size_t j = 0; j < pkg->files.count; j++)
+            if(pkg_file_list_push(&pkg->changes, pkg->files.files[j].name,
+                    strlen(pkg->files.files[j].name), DT_UNKNOWN, NULL, 0))
+                return 1;
+        if(watch_add_tree(ctx, i, ""))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * the targets are only held shared while changes are made, so sync and gc
+ * can run between batches.
+ */
+int
+watch_lock(struct watch_ctx *ctx)
+{
+    for(int i = 0; i < ctx->install_count; i++) {
+        ctx->lock_fds[i] = lock_target(ctx->install_dirs[i], 0,
+            ctx->opts->wait);
+        if(ctx->lock_fds[i] < 0) {
+            watch_unlock(ctx);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void
+watch_unlock(struct watch_ctx *ctx)
+{
+    for(int i = 0; i < ctx->install_count; i++) {
+        if(ctx->lock_fds[i] >= 0)
+            close(ctx->lock_fds[i]);
+        ctx->lock_fds[i] = -1;
+    }
+}
+
+/*
+ * install the packages, then keep the targets in line with their pkgfiles
+ * directories as files are made, removed and renamed. events are collected
+ * until WATCH_SETTLE_MS pass without one, or at most WATCH_BATCH_MS, and
+ * applied together.
+ */
+int
+watch(
+    char **package_dirs,
+    int package_count,
+    char **install_dirs,
+    int install_count,
+    struct install_opts *opts)
+{
+    int ret = 0;
+    int overflow, ready, pending;
+    char *buf;
+    struct pollfd pfd;
+    struct timespec start, now;
+    struct watch_ctx ctx;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.fd = -1;
+    ctx.install_dirs = install_dirs;
+    ctx.install_count = install_count;
+    ctx.opts = opts;
+
+    buf = malloc(WATCH_BUF_SIZE);
+    ctx.pkgs = calloc(package_count, sizeof(*ctx.pkgs));
+    ctx.lock_fds = malloc(install_count * sizeof(*ctx.lock_fds));
+    for(int i = 0; ctx.lock_fds != NULL && i < install_count; i++)
+        ctx.lock_fds[i] = -1;
+    if(buf == NULL || ctx.pkgs == NULL || ctx.lock_fds == NULL) {
+        perror("malloc failed");
+        ret = 1;
+        goto cleanup;
+    }
+    ctx.pkg_count = package_count;
+
+    ctx.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(ctx.fd < 0) {
+        perror("inotify_init1 failed");
+        ret = 1;
+        goto cleanup;
+    }
+
+    /* watch first so nothing changed after the install is missed */
+    for(int i = 0; i < package_count; i++) {
+        struct watch_pkg *pkg = &ctx.pkgs[i];
+        pkg->pkg_dir = package_dirs[i];
+        pkg->pkgfiles_dir = malloc(PATH_MAX);
+        pkg->real_pkgfiles_dir = malloc(PATH_MAX);
+        if(pkg->pkgfiles_dir == NULL || pkg->real_pkgfiles_dir == NULL) {
+            perror("malloc failed");
+            ret = 1;
+            goto cleanup;
+        }
+        if(snprintf(pkg->pkgfiles_dir, PATH_MAX, "%s/%s", package_dirs[i],
+                PACKAGE_FILES_DIRNAME) >= PATH_MAX) {
+            fprintf(stderr, "'%s' in '%s' exceeds PATH_MAX\n",
+                PACKAGE_FILES_DIRNAME, package_dirs[i]);
+            ret = 1;
+            goto cleanup;
+        }
+        if(realpath(pkg->pkgfiles_dir, pkg->real_pkgfiles_dir) == NULL) {
+            char *err = strerror(errno);
+            fprintf(stderr, "failed to get real path of '%s': %s\n",
+                pkg->pkgfiles_dir, err);
+            ret = 1;
+            goto cleanup;
+        }
+        if(watch_add_tree(&ctx, i, "")) {
+            ret = 1;
+            goto cleanup;
+        }
+        pkg_file_list_free(&pkg->changes);
+    }
+
+    if(watch_lock(&ctx)) {
+        ret = 1;
+        goto cleanup;
+    }
+    if(install(package_dirs, package_count, install_dirs, install_count,
+            opts)) {
+        ret = 1;
+        goto cleanup;
+    }
+    watch_unlock(&ctx);
+    for(int i = 0; i < package_count; i++)
+        if(read_pkg_filter(package_dirs[i], &opts->filter, &ctx.pkgs[i].filter)
+            || load_pkg_files(package_dirs[i], ctx.pkgs[i].pkgfiles_dir,
+                &ctx.pkgs[i].files)
+            || filter_pkg_files(&ctx.pkgs[i].filter, &ctx.pkgs[i].files)) {
+            ret = 1;
+            goto cleanup;
+        }
+    printf("watching %d packages\n", package_count);
+    fflush(stdout);
+
+    for(;;) {
+        pfd.fd = ctx.fd;
+        pfd.events = POLLIN;
+        /* changes left by a busy target are retried without a new event */
+        pending = 0;
+        for(int i = 0; i < ctx.pkg_count; i++)
+            if(ctx.pkgs[i].changes.count > 0)
+                pending = 1;
+        ready = poll(&pfd, 1, pending ? WATCH_RETRY_MS : -1);
+        if(ready < 0) {
+            if(errno == EINTR)
+                continue;
+            perror("poll failed");
+            ret = 1;
+            goto cleanup;
+        }
+
+        overflow = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        while(ready > 0 || (ready < 0 && errno == EINTR)) {
+            if(ready > 0 && watch_read(&ctx, buf, &overflow)) {
+                ret = 1;
+                goto cleanup;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if((now.tv_sec - start.tv_sec) * 1000
+                    + (now.tv_nsec - start.tv_nsec) / 1000000
+                    >= WATCH_BATCH_MS)
+                break;
+            ready = poll(&pfd, 1, WATCH_SETTLE_MS);
+        }
+
+        if(overflow && watch_resync(&ctx)) {
+            ret = 1;
+            goto cleanup;
+        }
+        /* with --no-wait a busy target leaves the changes for next time */
+        if(watch_lock(&ctx))
+            continue;
+        for(int i = 0; i < ctx.pkg_count; i++)
+            if(ctx.pkgs[i].changes.count > 0 && watch_apply(&ctx, i))
+                fprintf(stderr, "failed to apply changes of '%s'\n",
+                    ctx.pkgs[i].pkg_dir);
+        watch_unlock(&ctx);
+        fflush(stdout);
+    }
+
+cleanup:
+    if(ctx.lock_fds != NULL)
+        watch_unlock(&ctx);
+    if(ctx.fd >= 0)
+        close(ctx.fd);
+    if(ctx.pkgs != NULL)
+        for(int i = 0; i < ctx.pkg_count; i++) {
+            free(ctx.pkgs[i].pkgfiles_dir);
+            free(ctx.pkgs[i].real_pkgfiles_dir);
+            pkg_file_list_free(&ctx.pkgs[i].files);
+            pkg_file_list_free(&ctx.pkgs[i].changes);
+            filter_free(&ctx.pkgs[i].filter);
+        }
+    for(int i = 0; i < ctx.dir_capacity; i++)
+        free(ctx.dirs[i].name);
+    free(ctx.dirs);
+    free(ctx.pkgs);
+    free(ctx.lock_fds);
+    free(buf);
+    return ret;
+}
+
+int
+main(int argc, char **argv)
+{
+    int ret = 0;
+    char *install_dir, *default_package_dir;
+    char **package_dirs, **install_dirs;
+    int package_count, install_count, arg, lock_count, *lock_fds;
+    struct install_opts opts;
+
+    default_package_dir = DEFAULT_PACKAGE_DIR;
+    install_dirs = NULL;
+    lock_fds = NULL;
+    lock_count = 0;
+    memset(&opts.filter, 0, sizeof(opts.filter));
+
+    if(argc < 2) {
+        fprintf(stderr, "too few arguments\n");
+        ret = 1;
+        goto done;
+    }
+
+    if(strcmp(argv[1], "digest") == 0 || strcmp(argv[1], "verify") == 0
+        || strcmp(argv[1], "index") == 0) {
+        if(argc == 2) {
+            package_dirs = &default_package_dir;
+            package_count = 1;
+        } else {
+            package_dirs = &argv[2];
+            package_count = argc - 2;
+        }
+        if(strcmp(argv[1], "digest") == 0)
+            ret = digest(package_dirs, package_count);
+        else if(strcmp(argv[1], "verify") == 0)
+            ret = verify(package_dirs, package_count);
+        else
+            ret = index_pkgs(package_dirs, package_count);
+        goto done;
+    }
+
+    if(strcmp(argv[1], "gc") == 0) {
+        int dry_run = argc > 2 && strcmp(argv[2], "-n") == 0;
+        if(argc > 3 + dry_run) {
+            fprintf(stderr, "too many arguments\n");
+            ret = 1;
+        } else {
+            install_dir = argc > 2 + dry_run
+                ? argv[2 + dry_run] : DEFAULT_INSTALL_DIR;
+            lock_fds = malloc(sizeof(*lock_fds));
+            if(lock_fds == NULL) {
+                perror("malloc failed");
+                ret = 1;
+                goto done;
+            }
+            lock_fds[0] = lock_target(install_dir, 1, 1);
+            if(lock_fds[0] < 0) {
+                ret = 1;
+                goto done;
+            }
+            lock_count = 1;
+            ret = gc(install_dir, dry_run);
+        }
+        goto done;
+    }
+
+    if(strcmp(argv[1], "install") != 0 && strcmp(argv[1], "uninstall") != 0
+        && strcmp(argv[1], "sync") != 0 && strcmp(argv[1], "watch") != 0) {
+        fprintf(stderr, "unrecognised subcommand '%s'\n", argv[1]);
+        ret = 1;
+        goto done;
+    }
+
+    install_dirs = malloc(argc * sizeof(*install_dirs));
+    lock_fds = malloc(argc * sizeof(*lock_fds));
+    if(install_dirs == NULL || lock_fds == NULL) {
+        perror("malloc failed");
+        ret = 1;
+        goto done;
+    }
+    install_count = 0;
+    opts.jobs = 1;
+    opts.flatten_links = 0;
+    opts.wait = 1;
+    for(arg = 2; arg < argc && argv[arg][0] == '-'; arg++) {
+        if(strcmp(argv[arg], "--") == 0) {
+            arg++;
+            break;
+        }
+        if(strcmp(argv[arg], "--flatten-links") == 0) {
+            opts.flatten_links = 1;
+            continue;
+        }
+        if(strcmp(argv[arg], "--no-wait") == 0) {
+            opts.wait = 0;
+            continue;
+        }
+        if(arg + 1 >= argc) {
+            fprintf(stderr, "option '%s' requires an argument\n", argv[arg]);
+            ret = 1;
+            goto done;
+        }
+        if(strcmp(argv[arg], "-t") == 0) {
+            install_dirs[install_count++] = argv[++arg];
+        } else if(strcmp(argv[arg], "--include") == 0
+            || strcmp(argv[arg], "--exclude") == 0) {
+            if(filter_add_rule(&opts.filter, argv[arg + 1],
+                    strcmp(argv[arg], "--exclude") == 0)) {
+                ret = 1;
+                goto done;
+            }
+            arg++;
+        } else if(strcmp(argv[arg], "-j") == 0) {
+            opts.jobs = atoi(argv[++arg]);
+            if(opts.jobs < 1) {
+                fprintf(stderr, "invalid job count '%s'\n", argv[arg]);
+                ret = 1;
+                goto done;
+            }
+        } else {
+            fprintf(stderr, "unrecognised option '%s'\n", argv[arg]);
+            ret = 1;
+            goto done;
+        }
+    }
+
+    if(strcmp(argv[1], "uninstall") == 0 && opts.filter.count > 0) {
+        fprintf(stderr, "uninstall takes no --include or --exclude rules\n");
+        ret = 1;
+        goto done;
+    }
+
+    /* with -t every remaining argument is a package directory */
+    if(install_count > 0 && arg < argc) {
+        package_dirs = &argv[arg];
+        package_count = argc - arg;
+    } else if(install_count > 0 || arg == argc) {
+        package_dirs = &default_package_dir;
+        package_count = 1;
+    } else if(arg == argc - 1) {
+        package_dirs = &argv[arg];
+        package_count = 1;
+    } else {
+        package_dirs = &argv[arg];
+        package_count = argc - arg - 1;
+        install_dirs[install_count++] = argv[argc - 1];
+    }
+    if(install_count == 0)
+        install_dirs[install_count++] = DEFAULT_INSTALL_DIR;
+
+    /*
+     * sync decides what to change from the whole target so owns it. watch
+     * runs until killed, it takes the target only while applying changes.
+     */
+    for(; strcmp(argv[1], "watch") != 0 && lock_count < install_count;
+            lock_count++) {
+        lock_fds[lock_count] = lock_target(install_dirs[lock_count],
+            strcmp(argv[1], "sync") == 0, opts.wait);
+        if(lock_fds[lock_count] < 0) {
+            ret = 1;
+            goto done;
+        }
+    }
+
+    if(strcmp(argv[1], "install") == 0) {
+        if(install(package_dirs, package_count, install_dirs, install_count,
+                &opts))
+            ret = 1;
+    } else if(strcmp(argv[1], "uninstall") == 0) {
+        if(uninstall(package_dirs, package_count, install_dirs, install_count,
+                &opts))
+            ret = 1;
+    } else if(strcmp(argv[1], "sync") == 0) {
+        if(install_count != 1 || package_count != 1) {
+            fprintf(stderr, "sync takes one list file and one target\n");
+            ret = 1;
+        } else if(sync_pkgs(package_dirs[0], install_dirs[0], &opts)) {
+            ret = 1;
+        }
+    } else if(strcmp(argv[1], "watch") == 0) {
+        if(watch(package_dirs, package_count, install_dirs, install_count,
+                &opts))
+            ret = 1;
     }
 
 done:
+    for(int i = 0; i < lock_count; i++)
+        close(lock_fds[i]);
+    free(lock_fds);
+    free(install_dirs);
+    filter_free(&opts.filter);
     printf("DONE (%d)\n", ret);
     return ret;
 }